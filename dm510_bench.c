@@ -0,0 +1,474 @@
+/* Throughput and latency benchmark for the dm510 devices.
+ *
+ * Writer threads send fixed size messages into /dev/dm510-0 and reader
+ * threads receive them from /dev/dm510-1. Every message carries the time
+ * it was sent, so the readers can measure the delivery latency of each
+ * one. At the end it prints MB/s, messages/s and latency percentiles.
+ *
+ * Usage: dm510_bench [options]
+ *   -s bytes     message size, at least 16 (default 64)
+ *   -n count     messages to send in total (default 1000000)
+ *   -q depth     messages moved per read()/write() call (default 1)
+ *   -W writers   writer threads (default 1)
+ *   -R readers   reader threads (default 1)
+ *   -B bytes     buffer size to set with SET_BUFFER_SIZE first
+ *   -c cpus      comma separated CPUs to pin writers, then readers, to
+ *   -m mode      block, nonblock, poll or mmap (default block)
+ *
+ * With more than one writer or reader the buffer is switched to record
+ * mode, so messages stay whole. Each write is then one record, so -q only
+ * batches reads. In mmap mode the single reader consumes straight from
+ * the mapped buffer and writers block in write() as usual.
+ *
+ * Run it with the same options before and after a change to dm510_dev.c
+ * and compare the numbers.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ioctl_commands.h"
+
+enum mode { MODE_BLOCK, MODE_NONBLOCK, MODE_POLL, MODE_MMAP };
+
+static size_t msg_size = 64;
+static long long total = 1000000;
+static int depth = 1;
+static int nr_writers = 1, nr_readers = 1;
+static int buffer_size;
+static enum mode mode = MODE_BLOCK;
+static int record_mode;
+static int cpus[256], nr_cpus;
+static int nr_done;  // Readers that have stopped
+
+// Every message starts with this header, the rest is padding
+struct msg {
+    uint64_t sent_ns;
+    uint64_t seq;  // POISON tells a reader to stop
+};
+
+#define POISON UINT64_MAX
+
+struct reader {
+    pthread_t thread;
+    int cpu;
+    long long received;
+    uint64_t *lat;  // Latency of every message received, in ns
+    long long nr_lat;
+};
+
+struct writer {
+    pthread_t thread;
+    int cpu;
+    long long first, count;  // Sequence numbers it sends
+};
+
+static long long lat_capacity;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void die(const char *what) {
+    perror(what);
+    exit(1);
+}
+
+static void pin(int cpu) {
+    cpu_set_t set;
+
+    if (cpu < 0)
+        return;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1)
+        die("sched_setaffinity");
+}
+
+static int open_dev(const char *path, int flags) {
+    int fd;
+
+    if (mode == MODE_NONBLOCK || mode == MODE_POLL)
+        flags |= O_NONBLOCK;
+    fd = open(path, flags);
+    if (fd == -1)
+        die(path);
+    return fd;
+}
+
+// Retry until the device accepts or returns something, the way the mode asks for
+static ssize_t xfer(int fd, void *buf, size_t len, int out) {
+    for (;;) {
+        ssize_t ret = out ? write(fd, buf, len) : read(fd, buf, len);
+
+        if (ret >= 0)
+            return ret;
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN)
+            die(out ? "write" : "read");
+        if (mode == MODE_POLL) {
+            struct pollfd pfd = { .fd = fd, .events = out ? POLLOUT : POLLIN };
+
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                die("poll");
+        }
+    }
+}
+
+static void write_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t ret = xfer(fd, p, len, 1);
+
+        p += ret;
+        len -= ret;
+    }
+}
+
+static void fill(struct msg *m, uint64_t seq) {
+    m->seq = seq;
+    m->sent_ns = now_ns();
+}
+
+static void *writer_main(void *arg) {
+    struct writer *w = arg;
+    char *buf = calloc(depth, msg_size);
+    long long i = 0;
+    int fd;
+
+    if (!buf)
+        die("calloc");
+    pin(w->cpu);
+    fd = open_dev("/dev/dm510-0", O_WRONLY);
+
+    while (i < w->count) {
+        int batch = record_mode ? 1 : depth;
+        int j;
+
+        if (batch > w->count - i)
+            batch = w->count - i;
+        for (j = 0; j < batch; j++)
+            fill((struct msg *)(buf + j * msg_size), w->first + i + j);
+        write_all(fd, buf, batch * msg_size);
+        i += batch;
+    }
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+// Returns 1 once the reader has everything it should get
+static int consume(struct reader *r, const char *buf, size_t len) {
+    size_t off;
+
+    for (off = 0; off + msg_size <= len; off += msg_size) {
+        const struct msg *m = (const struct msg *)(buf + off);
+
+        if (m->seq == POISON)
+            return 1;
+        if (r->nr_lat < lat_capacity)
+            r->lat[r->nr_lat++] = now_ns() - m->sent_ns;
+        r->received++;
+    }
+    return nr_readers == 1 && r->received == total;
+}
+
+static void *reader_main(void *arg) {
+    struct reader *r = arg;
+    size_t size = depth * msg_size;
+    char *buf = malloc(size);
+    size_t have = 0;
+    int fd, done = 0;
+
+    if (!buf)
+        die("malloc");
+    pin(r->cpu);
+    fd = open_dev("/dev/dm510-1", O_RDONLY);
+
+    // In stream mode a read may end inside a message, so keep the tail
+    // around until the rest of it arrives
+    while (!done) {
+        ssize_t ret = xfer(fd, buf + have, size - have, 0);
+        size_t whole;
+
+        have += ret;
+        whole = have - have % msg_size;
+        done = consume(r, buf, whole);
+        memmove(buf, buf + whole, have - whole);
+        have -= whole;
+    }
+    close(fd);
+    free(buf);
+    __atomic_add_fetch(&nr_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void ring_copy(char *dst, const char *data, size_t size, uint64_t pos, size_t len) {
+    size_t at = pos % size;
+    size_t first = len < size - at ? len : size - at;
+
+    memcpy(dst, data + at, first);
+    memcpy(dst + first, data, len - first);
+}
+
+// Consume straight from the mapped buffer, no read() involved
+static void *mmap_reader_main(void *arg) {
+    struct reader *r = arg;
+    long page = sysconf(_SC_PAGESIZE);
+    struct dm510_ring_ctrl *ctrl;
+    size_t size, map_len;
+    char *map, *data, *buf;
+    int fd, done = 0;
+
+    pin(r->cpu);
+    fd = open("/dev/dm510-1", O_RDWR);
+    if (fd == -1)
+        die("/dev/dm510-1");
+    ctrl = mmap(NULL, page, PROT_READ, MAP_SHARED, fd, DM510_MMAP_READ_BUFFER);
+    if (ctrl == MAP_FAILED)
+        die("mmap");
+    size = ctrl->size;
+    munmap(ctrl, page);
+
+    map_len = page + (size + page - 1) / page * page;
+    map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, DM510_MMAP_READ_BUFFER);
+    if (map == MAP_FAILED)
+        die("mmap");
+    ctrl = (struct dm510_ring_ctrl *)map;
+    data = map + page;
+    buf = malloc(size);
+    if (!buf)
+        die("malloc");
+
+    while (!done) {
+        uint64_t head = ctrl->head;
+        uint64_t tail = __atomic_load_n(&ctrl->tail, __ATOMIC_ACQUIRE);
+        size_t len = 0;
+
+        if (head == tail) {
+            struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+            if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+                die("poll");
+            continue;
+        }
+        if (record_mode) {
+            // Unwrap whole records into buf, dropping their headers
+            while (head < tail && len + msg_size <= size) {
+                uint32_t rec;
+
+                ring_copy((char *)&rec, data, size, head, sizeof(rec));
+                ring_copy(buf + len, data, size, head + DM510_RECORD_HEADER_SIZE, rec);
+                head += DM510_RECORD_HEADER_SIZE + rec;
+                len += rec;
+            }
+        } else {
+            len = (tail - head) - (tail - head) % msg_size;
+            ring_copy(buf, data, size, head, len);
+            head += len;
+        }
+        __atomic_store_n(&ctrl->head, head, __ATOMIC_RELEASE);
+        if (ioctl(fd, WAKE_BUFFER_WAITERS) == -1)  // Blocked writers don't see our store otherwise
+            die("WAKE_BUFFER_WAITERS");
+        done = consume(r, buf, len);
+    }
+    munmap(map, map_len);
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const uint64_t *lat, long long n, double p) {
+    long long i = (long long)(p * (n - 1));
+
+    return n ? lat[i] / 1000.0 : 0;
+}
+
+// The fd is kept open for the whole run, so the channel can't be reclaimed
+// and its settings lost before the readers and writers have opened it
+static int setup(void) {
+    int fd = open("/dev/dm510-0", O_RDWR);
+
+    if (fd == -1)
+        die("/dev/dm510-0");
+    if (buffer_size && ioctl(fd, SET_BUFFER_SIZE, &buffer_size) == -1)
+        die("SET_BUFFER_SIZE");
+    if (ioctl(fd, SET_RECORD_MODE, &record_mode) == -1)
+        die("SET_RECORD_MODE");
+    return fd;
+}
+
+// Throw away poison records nobody needed, so the next run starts empty
+static void drain(void) {
+    size_t size = msg_size > 4096 ? msg_size : 4096;  // A record read needs room for one
+    char *buf = malloc(size);
+    int fd = open("/dev/dm510-1", O_RDONLY | O_NONBLOCK);
+
+    if (!buf || fd == -1)
+        die("/dev/dm510-1");
+    while (read(fd, buf, size) > 0)
+        ;
+    close(fd);
+    free(buf);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s size] [-n count] [-q depth] [-W writers] [-R readers]\n"
+                    "       [-B buffer size] [-c cpu,cpu,...] [-m block|nonblock|poll|mmap]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct writer *writers;
+    struct reader *readers;
+    long long received = 0, nr_lat = 0, sent = 0;
+    uint64_t *lat;
+    uint64_t start, elapsed;
+    int opt, i, next_cpu = 0, setup_fd;
+    char *tok;
+
+    while ((opt = getopt(argc, argv, "s:n:q:W:R:B:c:m:")) != -1) {
+        switch (opt) {
+        case 's': msg_size = strtoul(optarg, NULL, 0); break;
+        case 'n': total = strtoll(optarg, NULL, 0); break;
+        case 'q': depth = atoi(optarg); break;
+        case 'W': nr_writers = atoi(optarg); break;
+        case 'R': nr_readers = atoi(optarg); break;
+        case 'B': buffer_size = atoi(optarg); break;
+        case 'c':
+            for (tok = strtok(optarg, ","); tok && nr_cpus < 256; tok = strtok(NULL, ","))
+                cpus[nr_cpus++] = atoi(tok);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "block"))
+                mode = MODE_BLOCK;
+            else if (!strcmp(optarg, "nonblock"))
+                mode = MODE_NONBLOCK;
+            else if (!strcmp(optarg, "poll"))
+                mode = MODE_POLL;
+            else if (!strcmp(optarg, "mmap"))
+                mode = MODE_MMAP;
+            else
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (msg_size < sizeof(struct msg) || total < 1 || depth < 1 || nr_writers < 1 || nr_readers < 1)
+        usage(argv[0]);
+    if (mode == MODE_MMAP && nr_readers != 1) {
+        fprintf(stderr, "mmap mode needs exactly one reader\n");
+        return 1;
+    }
+    record_mode = nr_writers > 1 || nr_readers > 1;
+    setup_fd = setup();
+
+    writers = calloc(nr_writers, sizeof(*writers));
+    readers = calloc(nr_readers, sizeof(*readers));
+    if (!writers || !readers)
+        die("calloc");
+    // Readers compete for messages, so any one of them may get nearly all
+    lat_capacity = total;
+
+    for (i = 0; i < nr_writers; i++) {
+        writers[i].cpu = nr_cpus ? cpus[next_cpu++ % nr_cpus] : -1;
+        writers[i].first = sent;
+        writers[i].count = total / nr_writers + (i < total % nr_writers);
+        sent += writers[i].count;
+    }
+    for (i = 0; i < nr_readers; i++) {
+        readers[i].cpu = nr_cpus ? cpus[next_cpu++ % nr_cpus] : -1;
+        readers[i].lat = malloc(lat_capacity * sizeof(uint64_t));
+        if (!readers[i].lat)
+            die("malloc");
+    }
+
+    start = now_ns();
+    for (i = 0; i < nr_readers; i++) {
+        if (pthread_create(&readers[i].thread, NULL,
+                           mode == MODE_MMAP ? mmap_reader_main : reader_main, &readers[i]))
+            die("pthread_create");
+    }
+    for (i = 0; i < nr_writers; i++) {
+        if (pthread_create(&writers[i].thread, NULL, writer_main, &writers[i]))
+            die("pthread_create");
+    }
+    for (i = 0; i < nr_writers; i++)
+        pthread_join(writers[i].thread, NULL);
+
+    // Several readers can't tell when the others are done, so once every
+    // message is queued they are sent poison messages to stop on. One read
+    // can return up to depth of them, so a reader may swallow several;
+    // keep sending until every reader has stopped.
+    if (nr_readers > 1) {
+        char *poison = calloc(1, msg_size);
+        int fd = open("/dev/dm510-0", O_WRONLY | O_NONBLOCK);
+
+        if (!poison || fd == -1)
+            die("poison");
+        ((struct msg *)poison)->seq = POISON;
+        while (__atomic_load_n(&nr_done, __ATOMIC_ACQUIRE) < nr_readers) {
+            if (write(fd, poison, msg_size) == -1) {
+                if (errno != EAGAIN && errno != EINTR)
+                    die("write");
+                usleep(1000);  // Full, the readers still have to get to them
+            }
+        }
+        close(fd);
+        free(poison);
+    }
+    for (i = 0; i < nr_readers; i++)
+        pthread_join(readers[i].thread, NULL);
+    elapsed = now_ns() - start;
+    if (nr_readers > 1)
+        drain();
+    close(setup_fd);
+
+    for (i = 0; i < nr_readers; i++)
+        nr_lat += readers[i].nr_lat;
+    lat = malloc((nr_lat + 1) * sizeof(uint64_t));
+    if (!lat)
+        die("malloc");
+    nr_lat = 0;
+    for (i = 0; i < nr_readers; i++) {
+        memcpy(lat + nr_lat, readers[i].lat, readers[i].nr_lat * sizeof(uint64_t));
+        nr_lat += readers[i].nr_lat;
+        received += readers[i].received;
+    }
+    qsort(lat, nr_lat, sizeof(uint64_t), cmp_u64);
+
+    printf("%lld messages of %zu bytes, %d writers, %d readers, depth %d%s\n",
+           received, msg_size, nr_writers, nr_readers, depth, record_mode ? ", record mode" : "");
+    printf("%.3f s, %.1f MB/s, %.0f messages/s\n", elapsed / 1e9,
+           received * msg_size / (elapsed / 1e9) / (1 << 20), received / (elapsed / 1e9));
+    printf("latency us: p50 %.2f p99 %.2f p999 %.2f max %.2f\n",
+           percentile(lat, nr_lat, 0.5), percentile(lat, nr_lat, 0.99),
+           percentile(lat, nr_lat, 0.999), percentile(lat, nr_lat, 1.0));
+    return received == total ? 0 : 1;
+}
@@ -7,133 +7,2227 @@
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/cdev.h>
+#include <linux/atomic.h>
+#include <linux/mm.h>
+#include <linux/highmem.h>
+#include <linux/poll.h>
+#include <linux/uio.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/ktime.h>
+#include <linux/xarray.h>
+#include <linux/moduleparam.h>
+#include <linux/file.h>
+#include <linux/sched.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/io_uring.h>
+#include <linux/eventfd.h>
+#include <linux/rcupdate.h>
+#include <linux/topology.h>
+#include <linux/nodemask.h>
 #include "ioctl_commands.h" 
 
+#define CREATE_TRACE_POINTS
+#include "dm510_trace.h"
+
 #define MIN_MINOR_NUMBER 0
-#define MAX_MINOR_NUMBER 1
 #define DEVICE_NAME "dm510"
-#define MAX_BUFFER_SIZE (1024 * 1024) // 1MB max buffer size
+#define DEFAULT_BUFFER_SIZE (1024 * 1024) // 1MB buffer size for new channels
+#define MAX_BUFFER_SIZE (256 * 1024 * 1024) // 256MB max buffer size
+#define MAX_CHANNELS ((MINORMASK + 1) / DEVICE_COUNT)
+#define MAX_SPIN_TIME 1000 // Longest a reader or writer may busy-poll, in microseconds
+#define MAX_QUEUES 16 // Most sub-rings a buffer can have; switching record mode holds all their mutexes
+#define READ_BUFFER_PGOFF (DM510_MMAP_READ_BUFFER >> PAGE_SHIFT)
+#define BULK_CHUNK (64 * 1024) // Stream transfers publish their progress at least this often
+#define NOCACHE_MIN (4 * 1024 * 1024) // Writes this large bypass the cache on their way in
+
+static int dm510_major;
+
+// Minors are reserved for max_channels channels at load time, but a channel
+// only gets its rings when one of its minors is first opened
+static unsigned int max_channels = 1;
+module_param(max_channels, uint, 0444);
+MODULE_PARM_DESC(max_channels, "Number of channels, each a pair of dm510 devices");
+
+static unsigned int buffer_size = DEFAULT_BUFFER_SIZE;
+module_param(buffer_size, uint, 0444);
+MODULE_PARM_DESC(buffer_size, "Ring size in bytes for newly created channels");
+
+static unsigned int nr_queues;
+module_param(nr_queues, uint, 0444);
+MODULE_PARM_DESC(nr_queues, "Sub-rings per buffer of new channels, 0 for a single ring");
+
+static unsigned int spin_time;
+module_param(spin_time, uint, 0644);
+MODULE_PARM_DESC(spin_time, "Microseconds new files busy-poll before sleeping, 0 to sleep at once");
+
+// Not just numa_node, which is the name of the kernel's per-CPU node id
+static int dm510_numa_node = DM510_NUMA_ANY;
+module_param_named(numa_node, dm510_numa_node, int, 0444);
+MODULE_PARM_DESC(numa_node, "NUMA node for the rings of new channels, -1 for the opener's, -2 for each reader's");
+
+// io_uring commands waiting for one side of a ring, see dm510_uring_cmd()
+struct dm510_cmd_queue {
+    spinlock_t lock;
+    struct list_head list;
+};
+
+// Single-producer/single-consumer ring: the consumer owns head, the producer
+// owns tail. Both are free-running byte counts, so occupancy is tail - head
+// and neither side ever writes a field the other one does. Each side
+// publishes its counter with release semantics and reads the other side's
+// with acquire semantics, so neither needs the other's lock.
+// The counters live in a control page that can be mmap()ed next to the data
+// pages, so user space can take either side of the ring without syscalls.
+// Fields are grouped by who writes them, one cache line per group, so a
+// reader and a writer on different CPUs don't bounce lines between them.
+struct dm510_buffer {
+    // Read-mostly, only written by resize and ioctls
+    struct page **pages;       // Order-0 data pages, so no high-order allocation is needed
+    size_t size;
+    size_t mask;               // size - 1 for power-of-two sizes, else 0
+    struct dm510_ring_ctrl *ctrl;
+    atomic_t mmap_count;       // Live user mappings; the ring can't be resized while mapped
+    size_t read_watermark;     // Readers are woken once used crosses this
+    size_t write_watermark;    // Writers are woken once free space crosses this
+    unsigned long read_timeout; // Jiffies a reader waits for read_watermark, 0 is forever
+    bool record_mode;          // Data is framed into records behind a length header
+    bool timestamps;           // Record headers also carry the time the record was written
+    int broadcast;             // DM510_BROADCAST_*, every reader sees every byte unless off
+    bool overwrite;            // A full ring drops its oldest data rather than making writers wait
+    int node;                  // NUMA node holding the data pages
+    int rehome;                // Move the pages to the node of the next reader to open, xchg()ed
+    struct eventfd_ctx __rcu *read_doorbell;  // Signalled when the ring stops being empty
+    struct eventfd_ctx __rcu *write_doorbell; // Signalled when the ring stops being full
+
+    // Multi-queue mode. The buffer itself then has no data pages: writers
+    // each append to one of the sub-rings, readers drain them round-robin
+    // and sleep on this buffer's read_queue. Sub-rings take the settings
+    // above from their hub.
+    struct dm510_buffer *queues;
+    unsigned int nr_queues;
+    struct dm510_buffer *hub;  // Set on sub-rings only
+    int minor;                 // Device writing into this ring, for tracing
+    atomic_t next_writer;      // Spreads new writers over the sub-rings
+
+    // Consumer side
+    struct mutex read_mutex ____cacheline_aligned_in_smp; // Serializes readers against each other
+    wait_queue_head_t read_queue;
+    atomic_t read_waiters;     // Readers topping up a partial read, see ring_produce()
+    unsigned int next_queue;   // Sub-ring the next multi-queue read starts at
+    struct dm510_cmd_queue read_cmds;
+    struct list_head readers;  // Files reading from this ring, with their cursors
+    u64 dropped;               // Bytes dropped to make room for writers
+
+    // Producer side
+    struct mutex write_mutex ____cacheline_aligned_in_smp; // Serializes writers against each other
+    wait_queue_head_t write_queue;
+    atomic_t write_waiters;    // Record writers waiting for room, see ring_consume()
+    struct dm510_cmd_queue write_cmds;
+};
+
+// Hot-path counters, kept per CPU so updating them never bounces a shared
+// cache line. They are only summed when debugfs is read.
+struct dm510_stats {
+    u64 bytes_in, bytes_out;   // Bytes written to and read from the device
+    u64 reads, writes;         // read/write calls, vectored or not
+    u64 eagain;                // Calls that returned -EAGAIN
+    u64 wait_ns;               // Time spent blocked waiting for data or space
+    u64 contended;             // Times a ring mutex was already held
+    u64 peak_used;             // Highest occupancy seen in the write ring
+    u64 remote_bytes;          // Bytes copied on a CPU of another NUMA node than the ring
+    u64 latency[DM510_LATENCY_BUCKETS]; // Timestamped records read, by log2 of ns queued
+};
+
+#define dm510_stat_add(device, field, n) this_cpu_add((device)->stats->field, (n))
+
+// Copies across sockets are what NUMA placement is meant to avoid
+#define dm510_stat_remote(device, buffer, n) do { \
+        if (READ_ONCE((buffer)->node) != numa_node_id()) \
+            dm510_stat_add(device, remote_bytes, n); \
+    } while (0)
+
+struct dm510_channel;
+
+// Each device reads from one ring of its channel and writes into the other,
+// so writing to dm510-0 feeds readers of dm510-1 and the other way round.
+struct dm510_device {
+    struct dm510_buffer *read_buffer;
+    struct dm510_buffer *write_buffer;
+    struct dm510_channel *channel;
+    struct dm510_stats __percpu *stats;
+    struct dentry *debugfs;
+    int minor;
+    // A device is the only reader of read_buffer and the only writer of
+    // write_buffer, so counting its opens caps the convoy on either mutex
+    atomic_t readers, writers;
+    int max_readers, max_writers; // 0 is unlimited
+    bool open_blocking;        // Opens past a limit sleep instead of failing
+    wait_queue_head_t open_queue;
+} ____cacheline_aligned_in_smp; // Neighbouring minors don't share lines
+
+// Channel n owns minors n * DEVICE_COUNT and up. It is created on first
+// open and reclaimed once nothing holds it open or mapped and both rings
+// are empty, so idle minors cost no ring memory. A channel configured
+// through an ioctl is kept until the module is unloaded instead, so its
+// settings outlive the file that made them.
+struct dm510_channel {
+    struct dm510_buffer buffers[BUFFER_COUNT];
+    struct dm510_device devices[DEVICE_COUNT];
+    atomic_t users;            // Open files and live mappings
+    bool configured;           // A device or ring setting was changed
+    unsigned long index;
+};
+
+// Per open file state, for settings that belong to one reader or writer
+// rather than to the device
+struct dm510_file {
+    struct dm510_device *device;
+    u64 spin_ns;               // Busy-poll this long before sleeping, 0 is never
+    size_t read_min;           // Bytes a read waits for once some data is queued
+    unsigned long read_time;   // Jiffies it waits for them, 0 is forever
+    unsigned int queue;        // Sub-ring this file writes to in multi-queue mode
+    size_t write_need;         // Room a non-blocking record write wants, 0 if none
+    // Broadcast mode, under read_mutex of the ring the device reads from
+    struct list_head reader;   // On the readers of that ring if open for reading
+    u64 cursor;                // Position this file reads from next
+    u64 dropped;               // Bytes pushed past this file because it lagged
+};
+
+static struct cdev dm510_cdev;
+static struct kmem_cache *dm510_channel_cache; // Keeps channels cache line aligned
+static DEFINE_XARRAY(dm510_channels);
+static DEFINE_MUTEX(dm510_channels_mutex); // Serializes channel lookup against reclaim
+static struct dentry *dm510_debugfs;
+
+// The control page is writable through mmap(), so anything read back from it
+// is clamped or reduced to an offset before it is used to address the ring.
+// The counters are 64 bits wide so they never wrap, which keeps the modulo
+// path correct for sizes that aren't a power of two.
+static inline size_t ring_used(struct dm510_buffer *buffer) {
+    u64 head = smp_load_acquire(&buffer->ctrl->head);
+    u64 tail = smp_load_acquire(&buffer->ctrl->tail);
+
+    return min_t(u64, tail - head, buffer->size);
+}
+
+static inline u64 ring_head(struct dm510_buffer *buffer) {
+    return READ_ONCE(buffer->ctrl->head); // Only read by the consumer itself
+}
+
+static inline u64 ring_tail(struct dm510_buffer *buffer) {
+    return READ_ONCE(buffer->ctrl->tail); // Only read by the producer itself
+}
+
+// Offset in the ring data of a free-running position
+static inline size_t ring_offset(struct dm510_buffer *buffer, u64 pos) {
+    return buffer->mask ? pos & buffer->mask : pos % buffer->size;
+}
+
+// The buffer holding the settings of a ring, which is the hub for sub-rings
+static inline struct dm510_buffer *ring_config(struct dm510_buffer *buffer) {
+    return buffer->hub ?: buffer;
+}
+
+static inline bool ring_record_mode(struct dm510_buffer *buffer) {
+    return READ_ONCE(ring_config(buffer)->record_mode);
+}
+
+static inline bool ring_timestamps(struct dm510_buffer *buffer) {
+    return READ_ONCE(ring_config(buffer)->timestamps);
+}
+
+// Bytes in front of each record's payload
+static inline size_t ring_header_size(struct dm510_buffer *buffer) {
+    return DM510_RECORD_HEADER_SIZE + (ring_timestamps(buffer) ? DM510_RECORD_TIMESTAMP_SIZE : 0);
+}
+
+// Whether a full ring makes room by dropping its oldest data
+static inline bool ring_lossy(struct dm510_buffer *buffer) {
+    return READ_ONCE(ring_config(buffer)->overwrite) ||
+           READ_ONCE(buffer->broadcast) == DM510_BROADCAST_DROP;
+}
+
+// Watermarks are clamped at use, so shrinking the ring can't make them unreachable
+static inline size_t ring_read_watermark(struct dm510_buffer *buffer) {
+    return min(READ_ONCE(ring_config(buffer)->read_watermark), buffer->size);
+}
+
+static inline size_t ring_write_watermark(struct dm510_buffer *buffer) {
+    return min(READ_ONCE(ring_config(buffer)->write_watermark), buffer->size);
+}
+
+// Bytes queued in a buffer, across all sub-rings in multi-queue mode
+static size_t dm510_used(struct dm510_buffer *buffer) {
+    size_t used = 0;
+    unsigned int i;
+
+    if (!buffer->nr_queues)
+        return ring_used(buffer);
+    for (i = 0; i < buffer->nr_queues; i++)
+        used += ring_used(&buffer->queues[i]);
+    return used;
+}
+
+// Bytes dropped by a lossy ring, summed over its sub-rings
+static u64 dm510_dropped(struct dm510_buffer *buffer) {
+    u64 dropped = READ_ONCE(buffer->dropped);
+    unsigned int i;
+
+    for (i = 0; i < buffer->nr_queues; i++)
+        dropped += READ_ONCE(buffer->queues[i].dropped);
+    return dropped;
+}
+
+static inline size_t ring_nr_pages(size_t size) {
+    return DIV_ROUND_UP(size, PAGE_SIZE);
+}
+
+static void dm510_free_pages(struct page **pages, size_t size) {
+    size_t i;
+
+    if (!pages)
+        return;
+    for (i = 0; i < ring_nr_pages(size); i++) {
+        if (pages[i])
+            __free_page(pages[i]);
+    }
+    kvfree(pages);
+}
+
+// Pages are zeroed since they may end up mapped into user space
+// node may be NUMA_NO_NODE for the node of the calling CPU
+static struct page **dm510_alloc_pages(size_t size, int node) {
+    size_t i, nr_pages = ring_nr_pages(size);
+    struct page **pages = kvmalloc_node(array_size(nr_pages, sizeof(*pages)), GFP_KERNEL | __GFP_ZERO, node);
+
+    if (!pages)
+        return NULL;
+    for (i = 0; i < nr_pages; i++) {
+        pages[i] = alloc_pages_node(node, GFP_KERNEL | __GFP_ZERO, 0);
+        if (!pages[i]) {
+            dm510_free_pages(pages, size);
+            return NULL;
+        }
+        cond_resched(); // Large rings take a while to populate
+    }
+    return pages;
+}
+
+// Copy len bytes starting at ring offset pos, walking page boundaries and
+// wrapping around the end of the ring.
+static size_t ring_copy_to_iter(struct dm510_buffer *buffer, u64 pos, size_t len, struct iov_iter *to) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t at = ring_offset(buffer, pos + done);
+        size_t offset = at & ~PAGE_MASK;
+        size_t chunk = min3(len - done, PAGE_SIZE - offset, buffer->size - at);
+        size_t copied = copy_page_to_iter(buffer->pages[at >> PAGE_SHIFT], offset, chunk, to);
+
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+    return done;
+}
+
+// A nocache copy uses non-temporal stores where the architecture has them,
+// so a multi-megabyte write doesn't flush the reader's working set out of
+// the cache with data that will be evicted again before it is read.
+static size_t ring_copy_from_iter(struct dm510_buffer *buffer, u64 pos, size_t len,
+                                  struct iov_iter *from, bool nocache) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t at = ring_offset(buffer, pos + done);
+        size_t offset = at & ~PAGE_MASK;
+        size_t chunk = min3(len - done, PAGE_SIZE - offset, buffer->size - at);
+        struct page *page = buffer->pages[at >> PAGE_SHIFT];
+        size_t copied;
+
+        if (nocache) {
+            void *addr = kmap_local_page(page);
+
+            copied = copy_from_iter_nocache(addr + offset, chunk, from);
+            kunmap_local(addr);
+        } else {
+            copied = copy_page_from_iter(page, offset, chunk, from);
+        }
+        done += copied;
+        if (copied < chunk)
+            break;
+    }
+    if (nocache)
+        wmb(); // Non-temporal stores aren't ordered by the release of tail
+    return done;
+}
+
+// Kernel-side counterparts, used for record headers
+static void ring_copy_out(struct dm510_buffer *buffer, u64 pos, void *dst, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t at = ring_offset(buffer, pos + done);
+        size_t offset = at & ~PAGE_MASK;
+        size_t chunk = min3(len - done, PAGE_SIZE - offset, buffer->size - at);
+
+        memcpy_from_page((char *)dst + done, buffer->pages[at >> PAGE_SHIFT], offset, chunk);
+        done += chunk;
+    }
+}
+
+static void ring_copy_in(struct dm510_buffer *buffer, u64 pos, const void *src, size_t len) {
+    size_t done = 0;
+
+    while (done < len) {
+        size_t at = ring_offset(buffer, pos + done);
+        size_t offset = at & ~PAGE_MASK;
+        size_t chunk = min3(len - done, PAGE_SIZE - offset, buffer->size - at);
+
+        memcpy_to_page(buffer->pages[at >> PAGE_SHIFT], offset, (const char *)src + done, chunk);
+        done += chunk;
+    }
+}
+
+static void dm510_buffer_setup(struct dm510_buffer *buffer, size_t size) {
+    mutex_init(&buffer->read_mutex);
+    mutex_init(&buffer->write_mutex);
+    init_waitqueue_head(&buffer->read_queue);
+    init_waitqueue_head(&buffer->write_queue);
+    spin_lock_init(&buffer->read_cmds.lock);
+    INIT_LIST_HEAD(&buffer->read_cmds.list);
+    spin_lock_init(&buffer->write_cmds.lock);
+    INIT_LIST_HEAD(&buffer->write_cmds.list);
+    INIT_LIST_HEAD(&buffer->readers);
+    atomic_set(&buffer->mmap_count, 0);
+    buffer->read_watermark = 1;
+    buffer->write_watermark = 1;
+    buffer->read_timeout = 0;
+    atomic_set(&buffer->write_waiters, 0);
+    atomic_set(&buffer->read_waiters, 0);
+    buffer->record_mode = false;
+    buffer->timestamps = false;
+    buffer->size = size;
+    buffer->mask = is_power_of_2(size) ? size - 1 : 0;
+}
+
+static int dm510_buffer_init(struct dm510_buffer *buffer, size_t size, int node) {
+    dm510_buffer_setup(buffer, size);
+    buffer->ctrl = (struct dm510_ring_ctrl *)get_zeroed_page(GFP_KERNEL);
+    buffer->pages = dm510_alloc_pages(size, node);
+    if (!buffer->ctrl || !buffer->pages)
+        return -ENOMEM;
+    buffer->ctrl->size = size;
+    buffer->node = page_to_nid(buffer->pages[0]); // Where it really went
+    return 0;
+}
+
+// A multi-queue buffer is only a hub, each sub-ring is a full ring of size bytes
+static int dm510_queues_init(struct dm510_buffer *buffer, size_t size, unsigned int count, int node) {
+    unsigned int i;
+    int ret;
+
+    dm510_buffer_setup(buffer, size);
+    atomic_set(&buffer->next_writer, 0);
+    buffer->queues = kcalloc(count, sizeof(*buffer->queues), GFP_KERNEL);
+    if (!buffer->queues)
+        return -ENOMEM;
+    buffer->nr_queues = count;
+    for (i = 0; i < count; i++) {
+        buffer->queues[i].hub = buffer;
+        ret = dm510_buffer_init(&buffer->queues[i], size, node);
+        if (ret)
+            return ret;
+    }
+    buffer->node = buffer->queues[0].node;
+    return 0;
+}
+
+static void dm510_buffer_free(struct dm510_buffer *buffer) {
+    unsigned int i;
+
+    for (i = 0; i < buffer->nr_queues; i++)
+        dm510_buffer_free(&buffer->queues[i]);
+    kfree(buffer->queues);
+    buffer->queues = NULL;
+    buffer->nr_queues = 0;
+    dm510_free_pages(buffer->pages, buffer->size);
+    free_page((unsigned long)buffer->ctrl);
+    if (rcu_access_pointer(buffer->read_doorbell))
+        eventfd_ctx_put(rcu_dereference_protected(buffer->read_doorbell, 1));
+    if (rcu_access_pointer(buffer->write_doorbell))
+        eventfd_ctx_put(rcu_dereference_protected(buffer->write_doorbell, 1));
+    RCU_INIT_POINTER(buffer->read_doorbell, NULL);
+    RCU_INIT_POINTER(buffer->write_doorbell, NULL);
+    buffer->pages = NULL;
+    buffer->ctrl = NULL;
+}
+
+static inline bool ring_crossed(size_t now, size_t delta, size_t mark) {
+    return now >= mark && now - delta < mark;
+}
+
+// Doorbells let a peer on an mmap()ed ring sleep on an eventfd instead of
+// in read() or poll(). They are only rung on the empty and full transitions,
+// so a busy ring costs one counter increment per burst, not per message.
+static inline void ring_doorbell(struct eventfd_ctx __rcu **slot) {
+    struct eventfd_ctx *ctx;
+
+    if (!rcu_access_pointer(*slot))
+        return;
+    rcu_read_lock();
+    ctx = rcu_dereference(*slot);
+    if (ctx)
+        eventfd_signal(ctx, 1);
+    rcu_read_unlock();
+}
+
+// The per command state lives in the pdu of the io_uring command
+struct dm510_cmd {
+    struct list_head node;     // On the read_cmds or write_cmds of a ring while queued
+    u64 addr;
+    u32 len;
+    pid_t owner;               // Process that submitted it, 0 once cancelled
+};
+
+static inline struct dm510_cmd *dm510_cmd_pdu(struct io_uring_cmd *ioucmd) {
+    return (struct dm510_cmd *)ioucmd->pdu;
+}
+
+static inline struct io_uring_cmd *dm510_cmd_ioucmd(struct dm510_cmd *cmd) {
+    return container_of((void *)cmd, struct io_uring_cmd, pdu);
+}
+
+static void dm510_cmd_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+
+// Hand every queued command back to its submitter's task to retry. They
+// can't be done here, since the user buffer lives in the submitter's mm.
+static void dm510_cmd_kick(struct dm510_cmd_queue *queue) {
+    struct dm510_cmd *cmd, *next;
+    LIST_HEAD(ready);
+
+    if (list_empty_careful(&queue->list)) // Pairs with the barrier in dm510_cmd_queue()
+        return;
+    spin_lock(&queue->lock);
+    list_splice_init(&queue->list, &ready);
+    spin_unlock(&queue->lock);
+    list_for_each_entry_safe(cmd, next, &ready, node) {
+        list_del_init(&cmd->node);
+        io_uring_cmd_complete_in_task(dm510_cmd_ioucmd(cmd), dm510_cmd_task);
+    }
+}
+
+// Readers of sub-rings sleep on the hub
+static inline void ring_wake_readers(struct dm510_buffer *buffer) {
+    struct dm510_buffer *config = ring_config(buffer);
+
+    if (trace_dm510_wake_enabled()) // Don't touch the counters unless someone listens
+        trace_dm510_wake(config->minor, false, dm510_used(buffer));
+    wake_up_interruptible_poll(&config->read_queue, EPOLLIN | EPOLLRDNORM);
+    dm510_cmd_kick(&config->read_cmds);
+}
+
+static inline void ring_wake_writers(struct dm510_buffer *buffer) {
+    if (trace_dm510_wake_enabled())
+        trace_dm510_wake(ring_config(buffer)->minor, true, dm510_used(buffer));
+    wake_up_interruptible_poll(&buffer->write_queue, EPOLLOUT | EPOLLWRNORM);
+    dm510_cmd_kick(&buffer->write_cmds);
+}
+
+// Whether leftover data should be passed on to another reader
+static inline bool ring_readers_waiting(struct dm510_buffer *buffer) {
+    return wq_has_sleeper(&buffer->read_queue) || !list_empty_careful(&buffer->read_cmds.list);
+}
+
+// A record writer waiting for room means the ring is as full as it gets,
+// even short of a watermark. Whole records rarely fill it to the byte.
+static inline bool ring_writers_stalled(struct dm510_buffer *buffer) {
+    return ring_used(buffer) &&
+           (atomic_read(&buffer->write_waiters) || !list_empty_careful(&buffer->write_cmds.list));
+}
+
+// Readers only sleep on an empty ring. They wake once a writer pushes used
+// across the read watermark, or after read_timeout to take whatever is there.
+// The wait is exclusive, so a crossing wakes one of N blocked readers rather
+// than all of them; the one that wins passes it on if it leaves data behind.
+static int dm510_wait_readable(struct dm510_buffer *buffer) {
+    long timeout = READ_ONCE(buffer->read_timeout) ?: MAX_SCHEDULE_TIMEOUT;
+    DEFINE_WAIT(wait);
+    int ret = 0;
+
+    for (;;) {
+        prepare_to_wait_exclusive(&buffer->read_queue, &wait, TASK_INTERRUPTIBLE);
+        if (ring_used(buffer) >= ring_read_watermark(buffer) || ring_writers_stalled(buffer))
+            break;
+        if (signal_pending(current)) {
+            ret = -ERESTARTSYS;
+            break;
+        }
+        timeout = schedule_timeout(timeout);
+        if (!timeout)
+            break;
+    }
+    finish_wait(&buffer->read_queue, &wait);
+
+    // A wake-up that picked us is lost to the others if we bail out on a
+    // signal, so hand it to the next reader
+    if (ret && ring_used(buffer))
+        ring_wake_readers(buffer);
+    return ret;
+}
+
+// Publish n bytes written at tail. Returns true if readers should be woken,
+// which is when the transfer pushes used across the read watermark, or on
+// any produce while readers top up a partial read. They may each want a
+// different amount, so each woken reader checks its own.
+static bool ring_produce(struct dm510_buffer *buffer, u64 tail, size_t n) {
+    size_t used;
+
+    smp_store_release(&buffer->ctrl->tail, tail + n);
+    // Reading head after publishing tail, like the reader reads tail after
+    // publishing head, means a sleeping reader is never missed: either we
+    // see its progress or it sees ours before it sleeps.
+    smp_mb();
+    used = ring_used(buffer);
+    if (ring_crossed(used, n, 1))
+        ring_doorbell(&ring_config(buffer)->read_doorbell);
+    if (READ_ONCE(buffer->broadcast))
+        return true; // Any reader may have caught up, whatever used is
+    return ring_crossed(used, n, ring_read_watermark(buffer)) || atomic_read(&buffer->read_waiters);
+}
+
+// Publish n bytes consumed at head. Returns true if writers should be woken,
+// which is when free space crosses the write watermark, or on any consume
+// while record writers wait for room. Their needs differ, so rather than
+// tracking the largest one each woken writer checks its own.
+static bool ring_consume(struct dm510_buffer *buffer, u64 head, size_t n) {
+    size_t free_space;
+
+    smp_store_release(&buffer->ctrl->head, head + n);
+    smp_mb(); // Pairs with ring_want_room() and dm510_cmd_queue()
+    free_space = buffer->size - ring_used(buffer);
+    if (ring_crossed(free_space, n, 1))
+        ring_doorbell(&ring_config(buffer)->write_doorbell);
+    return ring_crossed(free_space, n, ring_write_watermark(buffer)) ||
+           atomic_read(&buffer->write_waiters) || !list_empty_careful(&buffer->write_cmds.list);
+}
+
+// Count a record writer as waiting for room, before it checks for it.
+// Readers waiting for more than the ring holds are told to stop waiting.
+static inline void ring_want_room(struct dm510_buffer *buffer) {
+    atomic_inc(&buffer->write_waiters);
+    smp_mb__after_atomic(); // Pairs with the barrier in ring_consume()
+    ring_wake_readers(buffer);
+}
+
+static inline void ring_unwant_room(struct dm510_buffer *buffer) {
+    atomic_dec(&buffer->write_waiters);
+}
+
+// Wait condition for writers
+static bool ring_writable(struct dm510_buffer *buffer, size_t need) {
+    return buffer->size - ring_used(buffer) >= max(need, ring_write_watermark(buffer));
+}
+
+// Sleep until need bytes are free, or the ring was shrunk below need, so
+// the caller's retry fails with -EMSGSIZE. Called and returns with
+// write_mutex dropped; the caller rechecks after retaking it.
+static int dm510_wait_writable(struct dm510_buffer *buffer, size_t need) {
+    int ret;
+
+    if (need > 1)
+        ring_want_room(buffer);
+    ret = wait_event_interruptible(buffer->write_queue,
+                                   ring_writable(buffer, need) || need > READ_ONCE(buffer->size));
+    if (need > 1)
+        ring_unwant_room(buffer);
+    return ret;
+}
+
+// Writable for poll() as a blocked writer of this file would see it, so
+// pollers are only told once there is room for the record they last
+// failed to write, or once it can never fit and the write would fail
+static bool ring_poll_writable(struct dm510_file *file, struct dm510_buffer *buffer) {
+    size_t need = max_t(size_t, READ_ONCE(file->write_need), 1);
+
+    return ring_writable(buffer, need) || need > READ_ONCE(buffer->size);
+}
+
+static bool ring_readable(struct dm510_buffer *buffer, size_t need) {
+    return ring_used(buffer) >= need;
+}
+
+static bool ring_has_space(struct dm510_buffer *buffer, size_t need) {
+    return buffer->size - ring_used(buffer) >= need;
+}
+
+// Low-latency mode: busy-poll the ring for up to spin_ns before the caller
+// goes to sleep, so a peer running on another CPU hands over without a
+// schedule-out and wake-up. Gives up early if this CPU is wanted elsewhere.
+static bool dm510_spin(u64 spin_ns, struct dm510_buffer *buffer,
+                       bool (*ready)(struct dm510_buffer *, size_t), size_t need) {
+    u64 deadline;
+
+    if (!spin_ns)
+        return false;
+    deadline = ktime_get_ns() + spin_ns;
+    do {
+        if (ready(buffer, need))
+            return true;
+        cpu_relax();
+    } while (!need_resched() && !signal_pending(current) && ktime_get_ns() < deadline);
+    return false;
+}
+
+// Wait condition for a reader that has some data but wants need bytes.
+// need is clamped again on every check, since the ring may shrink while
+// we sleep, and a ring its writers can't add to is as full as it gets.
+static bool ring_filled(struct dm510_buffer *buffer, size_t need) {
+    return ring_used(buffer) >= min(need, READ_ONCE(buffer->size)) || ring_writers_stalled(buffer);
+}
+
+// Sleep until need bytes are queued or timeout jiffies pass, 0 is forever.
+// Called with read_mutex dropped; the caller reads whatever is there.
+static void dm510_wait_filled(struct dm510_buffer *buffer, size_t need, unsigned long timeout) {
+    atomic_inc(&buffer->read_waiters);
+    smp_mb__after_atomic(); // Pairs with the barrier in ring_produce()
+    if (timeout)
+        wait_event_interruptible_timeout(buffer->read_queue, ring_filled(buffer, need), timeout);
+    else
+        wait_event_interruptible(buffer->read_queue, ring_filled(buffer, need));
+    atomic_dec(&buffer->read_waiters);
+}
+
+// Account a wait for data or room that began at start
+static void dm510_waited(struct dm510_device *device, bool write, size_t need, u64 start) {
+    u64 ns = ktime_get_ns() - start;
+
+    dm510_stat_add(device, wait_ns, ns);
+    trace_dm510_block(device->minor, write, need, ns);
+}
+
+// IOCB_NOWAIT callers such as io_uring must not sleep on the mutex either
+static int dm510_lock(struct dm510_device *device, struct mutex *mutex, struct kiocb *iocb) {
+    u64 start;
+    int ret;
+
+    if (mutex_trylock(mutex))
+        return 0;
+    dm510_stat_add(device, contended, 1);
+    if (iocb->ki_flags & IOCB_NOWAIT)
+        return -EAGAIN;
+    start = ktime_get_ns();
+    ret = mutex_lock_interruptible(mutex);
+    trace_dm510_lock_wait(device->minor, ktime_get_ns() - start);
+    return ret ? -ERESTARTSYS : 0;
+}
+
+static inline bool dm510_nonblock(struct kiocb *iocb) {
+    return (iocb->ki_filp->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+}
+
+// Copy the queued bytes of the ring to the start of new pages
+static void ring_linearize(struct dm510_buffer *buffer, struct page **pages, size_t used) {
+    u64 head = ring_head(buffer);
+    size_t done = 0;
+
+    while (done < used) {
+        size_t src = ring_offset(buffer, head + done);
+        size_t chunk = min(used - done, buffer->size - src);
+
+        chunk = min(chunk, PAGE_SIZE - (src & ~PAGE_MASK));
+        chunk = min(chunk, PAGE_SIZE - (done & ~PAGE_MASK));
+        memcpy_page(pages[done >> PAGE_SHIFT], done & ~PAGE_MASK,
+                    buffer->pages[src >> PAGE_SHIFT], src & ~PAGE_MASK, chunk);
+        done += chunk;
+    }
+}
+
+// The new pages are allocated before any lock is taken, so a failed
+// allocation leaves the old ring untouched and working. Queued data is
+// carried over, so the ring can grow under backpressure without draining.
+// The same copy moves a ring to the pages of another NUMA node.
+static int dm510_buffer_resize(struct dm510_buffer *buffer, size_t size, int node) {
+    struct page **pages = dm510_alloc_pages(size, node);
+    struct dm510_file *file;
+    size_t used;
+    u64 head;
+    int ret = 0;
+
+    if (!pages)
+        return -ENOMEM;
+
+    // Resizing moves both indices, so it needs both sides stopped.
+    // Lock order is always write_mutex before read_mutex.
+    mutex_lock(&buffer->write_mutex);
+    mutex_lock(&buffer->read_mutex);
+    used = ring_used(buffer);
+    if (atomic_read(&buffer->mmap_count) || used > size) {
+        // User space holds the old pages and indices, or the queued data doesn't fit
+        ret = -EBUSY;
+        goto unlock;
+    }
+    ring_linearize(buffer, pages, used);
+    head = ring_head(buffer); // Broadcast cursors move along with head
+    list_for_each_entry(file, &buffer->readers, reader)
+        file->cursor = file->cursor > head ? file->cursor - head : 0;
+    swap(buffer->pages, pages);
+    swap(buffer->size, size);
+    buffer->mask = is_power_of_2(buffer->size) ? buffer->size - 1 : 0;
+    buffer->ctrl->size = buffer->size;
+    buffer->ctrl->head = 0;
+    buffer->ctrl->tail = used;
+    WRITE_ONCE(buffer->node, page_to_nid(buffer->pages[0]));
+unlock:
+    mutex_unlock(&buffer->read_mutex);
+    mutex_unlock(&buffer->write_mutex);
+    // Once swapped in, size and pages are the old ones
+    trace_dm510_resize(ring_config(buffer)->minor, ret ? buffer->size : size, ret ? size : buffer->size, ret);
+    dm510_free_pages(pages, size);
+
+    if (!ret) {
+        // Free space and watermark clamps may both have changed
+        ring_wake_writers(buffer);
+        ring_wake_readers(buffer);
+    }
+    return ret;
+}
+
+// Sub-rings are resized one by one, so a failure part way through leaves
+// the earlier ones at the new size; the hub reports the last size that took
+static int dm510_resize(struct dm510_buffer *buffer, size_t size, int node) {
+    unsigned int i;
+    int ret;
+
+    if (!buffer->nr_queues)
+        return dm510_buffer_resize(buffer, size, node);
+    for (i = 0; i < buffer->nr_queues; i++) {
+        ret = dm510_buffer_resize(&buffer->queues[i], size, node);
+        if (ret)
+            return ret;
+    }
+    WRITE_ONCE(buffer->size, size);
+    WRITE_ONCE(buffer->node, buffer->queues[0].node);
+    return 0;
+}
+
+// Time timestamped records spent queued goes into bucket fls64() of the
+// latency histogram, so bucket b counts latencies below 2^b ns. A stamp
+// in the future, which only a misbehaving mmap() producer can write,
+// counts as 0.
+static void dm510_record_latency(struct dm510_device *device, u64 now, u64 stamp) {
+    u64 delta = (s64)(now - stamp) > 0 ? now - stamp : 0;
+
+    dm510_stat_add(device, latency[min(fls64(delta), DM510_LATENCY_BUCKETS - 1)], 1);
+}
+
+// Copy out what a read returns from the used bytes queued at *pos and move
+// *pos past it. In stream mode that is as many bytes as fit, in record mode
+// as many whole records as fit, never part of one. The caller decides
+// whether to consume what was copied; reads that do pass the device to
+// account the latency of timestamped records to.
+static ssize_t ring_read_at(struct dm510_device *device, struct dm510_buffer *buffer,
+                            struct iov_iter *to, u64 *pos, size_t used) {
+    size_t header = ring_header_size(buffer);
+    ssize_t result = 0;
+    u64 now = 0, stamp;
+    size_t copied;
+    u32 length;
+
+    if (!ring_record_mode(buffer)) {
+        copied = ring_copy_to_iter(buffer, *pos, min(iov_iter_count(to), used), to);
+        if (copied == 0)
+            return -EFAULT;
+        *pos += copied;
+        return copied;
+    }
+
+    while (used >= header) {
+        ring_copy_out(buffer, *pos, &length, sizeof(length));
+        if (length > used - header)
+            return result ? result : -EIO; // Only a misbehaving mmap() producer gets here
+        if (length > iov_iter_count(to))
+            return result ? result : -EMSGSIZE;
+        copied = ring_copy_to_iter(buffer, *pos + header, length, to);
+        if (copied < length) {
+            iov_iter_revert(to, copied);
+            return result ? result : -EFAULT;
+        }
+        if (device && header > DM510_RECORD_HEADER_SIZE) {
+            // One clock read per call, the records are all picked up now
+            if (!now)
+                now = ktime_get_ns();
+            ring_copy_out(buffer, *pos + DM510_RECORD_HEADER_SIZE, &stamp, sizeof(stamp));
+            dm510_record_latency(device, now, stamp);
+        }
+        *pos += header + length;
+        used -= header + length;
+        result += length;
+    }
+    return result ? result : -EIO;
+}
+
+// Read from head and consume what was read. A bulk stream read is consumed
+// a chunk at a time, so a writer waiting on a full ring can refill it while
+// the rest is still being copied out.
+static ssize_t ring_read(struct dm510_device *device, struct dm510_buffer *buffer,
+                         struct iov_iter *to, size_t used, bool *wake) {
+    u64 head = ring_head(buffer), pos = head;
+    ssize_t result = 0, ret;
+    size_t chunk;
+
+    if (ring_record_mode(buffer)) {
+        ret = ring_read_at(device, buffer, to, &pos, used);
+        if (pos != head)
+            *wake = ring_consume(buffer, head, pos - head);
+        return ret;
+    }
+
+    for (;;) {
+        chunk = min_t(size_t, used, BULK_CHUNK);
+        ret = ring_read_at(device, buffer, to, &pos, chunk);
+        if (ret < 0)
+            return result ? result : ret;
+        result += ret;
+        used -= ret;
+        if (ret < chunk || !used || !iov_iter_count(to)) {
+            if (ring_consume(buffer, head, ret))
+                *wake = true;
+            return result;
+        }
+        if (ring_consume(buffer, head, ret))
+            ring_wake_writers(buffer); // Now, not once the whole read is done
+        head = pos;
+        cond_resched();
+    }
+}
+
+// Broadcast mode: each reader file reads from a cursor of its own and head
+// trails the slowest of them, so a writer only gets space back once every
+// reader is past it. Cursors are protected by read_mutex.
+static size_t ring_unread(struct dm510_buffer *buffer, struct dm510_file *file) {
+    u64 head = ring_head(buffer);
+    u64 tail = smp_load_acquire(&buffer->ctrl->tail);
+
+    return min_t(u64, tail - max(READ_ONCE(file->cursor), head), buffer->size);
+}
+
+// Bytes a read on this file could return right now
+static size_t dm510_readable(struct dm510_file *file) {
+    struct dm510_buffer *buffer = file->device->read_buffer;
+
+    return READ_ONCE(buffer->broadcast) ? ring_unread(buffer, file) : dm510_used(buffer);
+}
+
+// Where this file reads from next. A cursor that fell behind head, which
+// only a drop does, is caught up and the gap counted against the file.
+static u64 ring_cursor(struct dm510_buffer *buffer, struct dm510_file *file) {
+    u64 head = ring_head(buffer);
+
+    if (file->cursor < head) {
+        file->dropped += head - file->cursor;
+        WRITE_ONCE(file->cursor, head);
+    }
+    return file->cursor;
+}
+
+// Move head up to the slowest cursor. Returns true if writers should be woken.
+static bool ring_reclaim(struct dm510_buffer *buffer) {
+    u64 head = ring_head(buffer), slowest = U64_MAX;
+    struct dm510_file *file;
+
+    list_for_each_entry(file, &buffer->readers, reader)
+        slowest = min(slowest, max(file->cursor, head));
+    return slowest != U64_MAX && slowest > head && ring_consume(buffer, head, slowest - head);
+}
+
+// Only the slowest reader moving on can free any space
+static bool ring_advance(struct dm510_buffer *buffer, struct dm510_file *file, u64 pos) {
+    bool slowest = file->cursor == ring_head(buffer);
+
+    WRITE_ONCE(file->cursor, pos);
+    return slowest && ring_reclaim(buffer);
+}
+
+// Lossy rings: make room for need bytes by dropping the oldest data, whole
+// records in record mode. In broadcast mode any reader that still wanted it
+// is pushed past it. Called with write_mutex held. Readers hold read_mutex
+// across their copies, so taking it may sleep like any other lock here.
+static int ring_drop_oldest(struct dm510_device *device, struct dm510_buffer *buffer,
+                            size_t need, struct kiocb *iocb) {
+    size_t header = ring_header_size(buffer);
+    struct dm510_file *file;
+    size_t used, drop = 0;
+    u32 length;
+    u64 head;
+    int ret;
+
+    // Not even an O_NONBLOCK write may wait for a read to finish copying out
+    if (dm510_nonblock(iocb)) {
+        if (!mutex_trylock(&buffer->read_mutex)) {
+            dm510_stat_add(device, contended, 1);
+            return -EAGAIN;
+        }
+    } else if ((ret = dm510_lock(device, &buffer->read_mutex, iocb))) {
+        return ret;
+    }
+    head = ring_head(buffer);
+    used = ring_used(buffer);
+    if (!ring_record_mode(buffer)) {
+        drop = min(used, need - min(need, buffer->size - used));
+    } else {
+        while (buffer->size - (used - drop) < need && used - drop >= header) {
+            ring_copy_out(buffer, head + drop, &length, sizeof(length));
+            if (length > used - drop - header) {
+                drop = used; // Only a misbehaving mmap() producer gets here
+                break;
+            }
+            drop += header + length;
+        }
+    }
+    if (drop)
+        ring_consume(buffer, head, drop); // We are the writer that wanted the room
+    WRITE_ONCE(buffer->dropped, buffer->dropped + drop);
+    if (buffer->broadcast) {
+        list_for_each_entry(file, &buffer->readers, reader)
+            ring_cursor(buffer, file);
+    }
+    mutex_unlock(&buffer->read_mutex);
+    return 0;
+}
+
+// Broadcast mode: every reader sees every byte, from its own cursor.
+// Watermarks, read timeouts, read_min and spinning don't apply here.
+static ssize_t dm510_read_broadcast(struct dm510_file *file, struct kiocb *iocb, struct iov_iter *to) {
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer = device->read_buffer;
+    bool wake_writers = false;
+    ssize_t result;
+    size_t unread;
+    u64 start, pos;
+    int ret;
+
+    if ((ret = dm510_lock(device, &buffer->read_mutex, iocb)))
+        goto out;
+    while ((unread = ring_unread(buffer, file)) == 0) {
+        mutex_unlock(&buffer->read_mutex);
+        if (dm510_nonblock(iocb)) {
+            ret = -EAGAIN;
+            goto out;
+        }
+        // Not exclusive: a write is for every reader, so it wakes them all
+        start = ktime_get_ns();
+        ret = wait_event_interruptible(buffer->read_queue, ring_unread(buffer, file));
+        dm510_waited(device, false, 1, start);
+        if (ret)
+            return -ERESTARTSYS;
+        if ((ret = dm510_lock(device, &buffer->read_mutex, iocb)))
+            return ret;
+    }
+
+    pos = ring_cursor(buffer, file);
+    result = ring_read_at(device, buffer, to, &pos, unread);
+    wake_writers = ring_advance(buffer, file, pos);
+    mutex_unlock(&buffer->read_mutex);
+    if (wake_writers)
+        ring_wake_writers(buffer);
+    if (result > 0) {
+        dm510_stat_add(device, bytes_out, result);
+        dm510_stat_remote(device, buffer, result);
+        if (trace_dm510_dequeue_enabled())
+            trace_dm510_dequeue(device->minor, result, ring_used(buffer));
+    }
+    return result;
+
+out:
+    if (ret == -EAGAIN)
+        dm510_stat_add(device, eagain, 1);
+    return ret;
+}
+
+static bool dm510_queues_readable(struct dm510_buffer *buffer, size_t need) {
+    unsigned int i;
+
+    for (i = 0; i < buffer->nr_queues; i++) {
+        if (ring_used(&buffer->queues[i]) >= need)
+            return true;
+    }
+    return false;
+}
+
+// Read as much as fits from one sub-ring
+static ssize_t dm510_read_queue(struct dm510_device *device, struct dm510_buffer *queue,
+                                struct kiocb *iocb, struct iov_iter *to) {
+    bool wake_writers = false;
+    ssize_t ret = 0;
+    size_t used;
+
+    if ((ret = dm510_lock(device, &queue->read_mutex, iocb)))
+        return ret;
+    used = ring_used(queue);
+    if (used)
+        ret = ring_read(device, queue, to, used, &wake_writers);
+    mutex_unlock(&queue->read_mutex);
+    if (wake_writers)
+        ring_wake_writers(queue);
+    return ret;
+}
+
+// Multi-queue mode: drain the sub-rings round-robin, starting after the one
+// the previous read stopped at, so no writer starves the others. Order only
+// holds within a sub-ring. Readers wait for any sub-ring to have data;
+// watermarks, read timeouts and read_min don't apply here.
+static ssize_t dm510_read_queues(struct dm510_file *file, struct kiocb *iocb, struct iov_iter *to) {
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer = device->read_buffer;
+    ssize_t result = 0, ret = 0;
+    unsigned int i, first;
+    u64 start;
+
+    while (result == 0) {
+        if (!dm510_queues_readable(buffer, 1)) {
+            if (dm510_nonblock(iocb)) {
+                ret = -EAGAIN;
+                break;
+            }
+            start = ktime_get_ns();
+            ret = 0;
+            if (!dm510_spin(READ_ONCE(file->spin_ns), buffer, dm510_queues_readable, 1))
+                ret = wait_event_interruptible_exclusive(buffer->read_queue, dm510_queues_readable(buffer, 1));
+            dm510_waited(device, false, 1, start);
+            if (ret) {
+                if (dm510_queues_readable(buffer, 1))
+                    ring_wake_readers(buffer); // Pass on a wake-up we may have taken
+                return -ERESTARTSYS;
+            }
+        }
+
+        first = READ_ONCE(buffer->next_queue);
+        for (i = 0; i < buffer->nr_queues && iov_iter_count(to); i++) {
+            unsigned int n = (first + i) % buffer->nr_queues;
+
+            if (!ring_used(&buffer->queues[n]))
+                continue;
+            ret = dm510_read_queue(device, &buffer->queues[n], iocb, to);
+            if (ret < 0)
+                break;
+            result += ret;
+            WRITE_ONCE(buffer->next_queue, (n + 1) % buffer->nr_queues);
+        }
+        if (ret < 0)
+            break;
+        // Another reader may have drained what we saw, then just wait again
+    }
+
+    // As with a single ring, leftover data goes to the next blocked reader
+    if (dm510_queues_readable(buffer, 1) && ring_readers_waiting(buffer))
+        ring_wake_readers(buffer);
+    if (result > 0) {
+        dm510_stat_add(device, bytes_out, result);
+        dm510_stat_remote(device, buffer, result);
+        if (trace_dm510_dequeue_enabled())
+            trace_dm510_dequeue(device->minor, result, dm510_used(buffer));
+        return result;
+    }
+    if (ret == -EAGAIN)
+        dm510_stat_add(device, eagain, 1);
+    return ret;
+}
+
+// read(), readv() and io_uring all end up here, so a vectored read drains
+// the ring across every segment in a single locked pass.
+static ssize_t dm510_read_iter(struct kiocb *iocb, struct iov_iter *to) {
+    struct dm510_file *file = iocb->ki_filp->private_data;
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer = device->read_buffer;
+    ssize_t result;
+    size_t used, want;
+    bool wake_writers = false;
+    u64 start;
+    int ret;
+
+    dm510_stat_add(device, reads, 1);
+    if (iov_iter_count(to) == 0)
+        return 0;
+    if (buffer->nr_queues)
+        return dm510_read_queues(file, iocb, to);
+    if (READ_ONCE(buffer->broadcast))
+        return dm510_read_broadcast(file, iocb, to);
+    if ((ret = dm510_lock(device, &buffer->read_mutex, iocb)))
+        goto out;
+
+    // Wait for data to be available
+    while ((used = ring_used(buffer)) == 0) {
+        mutex_unlock(&buffer->read_mutex); // Release lock while waiting
+        if (dm510_nonblock(iocb)) {
+            ret = -EAGAIN; // Non-blocking read
+            goto out;
+        }
+        start = ktime_get_ns();
+        ret = dm510_spin(READ_ONCE(file->spin_ns), buffer, ring_readable, 1) ? 0 : dm510_wait_readable(buffer);
+        dm510_waited(device, false, 1, start);
+        if (ret)
+            return -ERESTARTSYS; // Interrupted while waiting
+        if ((ret = dm510_lock(device, &buffer->read_mutex, iocb)))
+            return ret;
+    }
+
+    // Like termios VMIN/VTIME: once data is there, a blocking read waits up
+    // to read_time for read_min bytes, so it returns in larger batches
+    want = min3(READ_ONCE(file->read_min), iov_iter_count(to), buffer->size);
+    if (used < want && !dm510_nonblock(iocb)) {
+        mutex_unlock(&buffer->read_mutex);
+        start = ktime_get_ns();
+        if (!dm510_spin(READ_ONCE(file->spin_ns), buffer, ring_readable, want))
+            dm510_wait_filled(buffer, want, READ_ONCE(file->read_time));
+        dm510_waited(device, false, want, start);
+        if ((ret = dm510_lock(device, &buffer->read_mutex, iocb)))
+            return ret;
+        used = ring_used(buffer);
+    }
+
+    // The producer only ever adds to used, so the snapshot taken above is a
+    // safe lower bound. Writers publish whole records, so in record mode it
+    // always covers at least one.
+    result = ring_read(device, buffer, to, used, &wake_writers);
+
+    mutex_unlock(&buffer->read_mutex);
+    if (wake_writers)
+        ring_wake_writers(buffer); // Wake up any waiting writers
+    // Readers wait exclusively and a writer only wakes one per crossing, so
+    // leftover data has to be passed on to the next blocked reader
+    if (ring_used(buffer) >= ring_read_watermark(buffer) && ring_readers_waiting(buffer))
+        ring_wake_readers(buffer);
+    if (result > 0) {
+        dm510_stat_add(device, bytes_out, result);
+        dm510_stat_remote(device, buffer, result);
+        if (trace_dm510_dequeue_enabled())
+            trace_dm510_dequeue(device->minor, result, ring_used(buffer));
+    }
+    return result;
+
+out:
+    if (ret == -EAGAIN)
+        dm510_stat_add(device, eagain, 1);
+    return ret;
+}
+
+// Stream mode: queue as much as fits. Returns 0 with *need set if the ring is full.
+static ssize_t ring_write_bytes(struct dm510_buffer *buffer, struct iov_iter *from, size_t *need, bool *wake) {
+    // The consumer only ever frees space, so this is a safe upper bound on used
+    size_t space_left = buffer->size - ring_used(buffer);
+    u64 tail = ring_tail(buffer);
+    size_t len, chunk, copied, done = 0;
+    bool nocache;
+
+    if (space_left == 0) {
+        *need = 1;
+        return 0;
+    }
+    // A bulk write is published a chunk at a time, so readers can drain
+    // the start of it while the rest is still being copied in
+    len = min(iov_iter_count(from), space_left);
+    nocache = len >= NOCACHE_MIN;
+    for (;;) {
+        chunk = min_t(size_t, len - done, BULK_CHUNK);
+        copied = ring_copy_from_iter(buffer, tail + done, chunk, from, nocache);
+        if (copied == 0)
+            return done ? done : -EFAULT;
+        if (copied < chunk || done + copied == len) {
+            if (ring_produce(buffer, tail + done, copied))
+                *wake = true;
+            return done + copied;
+        }
+        if (ring_produce(buffer, tail + done, copied))
+            ring_wake_readers(buffer); // Now, not once the whole write is done
+        done += copied;
+        cond_resched();
+    }
+}
+
+// Record mode: the whole write becomes one record behind a length header.
+// It is published in one go, so the reader never sees a partial record.
+// Returns 0 with *need set if the record doesn't fit yet.
+static ssize_t ring_write_record(struct dm510_buffer *buffer, struct iov_iter *from, size_t *need, bool *wake) {
+    size_t count = iov_iter_count(from);
+    size_t header = ring_header_size(buffer);
+    size_t total = header + count;
+    u32 length = count;
+    size_t copied;
+    u64 tail, stamp;
+
+    if (total > buffer->size)
+        return -EMSGSIZE;
+    if (buffer->size - ring_used(buffer) < total) {
+        *need = total;
+        return 0;
+    }
+    tail = ring_tail(buffer);
+    copied = ring_copy_from_iter(buffer, tail + header, count, from, count >= NOCACHE_MIN);
+    if (copied < count) {
+        iov_iter_revert(from, copied);
+        return -EFAULT;
+    }
+    ring_copy_in(buffer, tail, &length, sizeof(length));
+    if (header > DM510_RECORD_HEADER_SIZE) {
+        // Stamped once the payload is in, so the copy isn't counted as queueing
+        stamp = ktime_get_ns();
+        ring_copy_in(buffer, tail + DM510_RECORD_HEADER_SIZE, &stamp, sizeof(stamp));
+    }
+    if (ring_produce(buffer, tail, total))
+        *wake = true;
+    return count;
+}
+
+// The ring a file writes into: its own sub-ring in multi-queue mode, so
+// writers on different files don't share a mutex
+static struct dm510_buffer *dm510_write_ring(struct dm510_file *file) {
+    struct dm510_buffer *buffer = file->device->write_buffer;
+
+    return buffer->nr_queues ? &buffer->queues[file->queue] : buffer;
+}
+
+// write(), writev() and io_uring all end up here, so a batch of small
+// writes costs one mutex acquisition and at most one wake-up.
+static ssize_t dm510_write_iter(struct kiocb *iocb, struct iov_iter *from) {
+    struct dm510_file *file = iocb->ki_filp->private_data;
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer = dm510_write_ring(file);
+    ssize_t result = 0, ret;
+    size_t need = 1;
+    bool wake_readers = false;
+    u64 start;
+
+    dm510_stat_add(device, writes, 1);
+    if (iov_iter_count(from) == 0)
+        return 0;
+    if ((ret = dm510_lock(device, &buffer->write_mutex, iocb))) {
+        result = ret;
+        goto out;
+    }
+
+    while (iov_iter_count(from) > 0) {
+        // Checked on every pass, since the mode may change while we sleep
+        if (ring_record_mode(buffer))
+            ret = ring_write_record(buffer, from, &need, &wake_readers);
+        else
+            ret = ring_write_bytes(buffer, from, &need, &wake_readers);
+
+        if (ret < 0) {
+            if (result == 0) // Only return an error if nothing was written
+                result = ret;
+            break;
+        }
+        if (ret > 0) {
+            result += ret;
+            continue;
+        }
+        // A lossy ring makes room by dropping its oldest data instead. A
+        // full stream ring only asks for one byte, so drop room for all of
+        // the rest at once rather than a byte per pass.
+        if (ring_lossy(buffer)) {
+            ret = ring_drop_oldest(device, buffer, max(need, min(iov_iter_count(from), buffer->size)), iocb);
+            if (ret) {
+                if (result == 0)
+                    result = ret;
+                break;
+            }
+            continue;
+        }
+
+        // No room: drop the lock and wait for the reader to free need bytes
+        mutex_unlock(&buffer->write_mutex);
+        if (wake_readers) {
+            ring_wake_readers(buffer); // Let readers drain what is queued so far
+            wake_readers = false;
+        }
+        if (dm510_nonblock(iocb)) {
+            // A record needs more room than a stream write. Count the file
+            // as waiting until it gets it, so the reader wakes pollers as the
+            // room frees, and retry if it already has, since that wake-up
+            // has then come and gone.
+            if (need > 1) {
+                if (!xchg(&file->write_need, need))
+                    ring_want_room(buffer);
+                if (ring_writable(buffer, need) && !dm510_lock(device, &buffer->write_mutex, iocb))
+                    continue;
+            }
+            result = result ? result : -EAGAIN;
+            goto out;
+        }
+        start = ktime_get_ns();
+        ret = dm510_spin(READ_ONCE(file->spin_ns), buffer, ring_has_space, need) ? 0 : dm510_wait_writable(buffer, need);
+        dm510_waited(device, true, need, start);
+        if (ret || (ret = dm510_lock(device, &buffer->write_mutex, iocb))) {
+            result = result ? result : -ERESTARTSYS;
+            goto out;
+        }
+    }
+
+    mutex_unlock(&buffer->write_mutex);
+    if (wake_readers)
+        ring_wake_readers(buffer); // Wake up any waiting readers
+
+out:
+    // Once written, the room wanted on an earlier EAGAIN is no longer wanted
+    if (result > 0 && READ_ONCE(file->write_need) && xchg(&file->write_need, 0))
+        ring_unwant_room(buffer);
+    if (result > 0) {
+        u64 used = ring_used(buffer);
+
+        dm510_stat_add(device, bytes_in, result);
+        dm510_stat_remote(device, buffer, result);
+        if (used > this_cpu_read(device->stats->peak_used))
+            this_cpu_write(device->stats->peak_used, used);
+        trace_dm510_enqueue(device->minor, result, used);
+    } else if (result == -EAGAIN) {
+        dm510_stat_add(device, eagain, 1);
+    }
+    return result; // Return the number of bytes written
+}
+
+// Switch the format of the ring the device writes into, to one of the
+// DM510_RECORD_MODE_* values. Readers follow the format of the ring they
+// read from, so the ring must be empty to switch. In multi-queue mode every
+// sub-ring has to be stopped, so all their mutexes are taken under the
+// hub's, write side first as usual.
+static int dm510_set_record_mode(struct dm510_buffer *buffer, int mode) {
+    unsigned int i;
+    int ret = 0;
+
+    mutex_lock(&buffer->write_mutex);
+    for (i = 0; i < buffer->nr_queues; i++)
+        mutex_lock_nest_lock(&buffer->queues[i].write_mutex, &buffer->write_mutex);
+    mutex_lock(&buffer->read_mutex);
+    for (i = 0; i < buffer->nr_queues; i++)
+        mutex_lock_nest_lock(&buffer->queues[i].read_mutex, &buffer->read_mutex);
+    if (dm510_used(buffer))
+        ret = -EBUSY;
+    else {
+        WRITE_ONCE(buffer->record_mode, mode != DM510_RECORD_MODE_OFF);
+        WRITE_ONCE(buffer->timestamps, mode == DM510_RECORD_MODE_TIMESTAMPED);
+    }
+    for (i = 0; i < buffer->nr_queues; i++)
+        mutex_unlock(&buffer->queues[i].read_mutex);
+    mutex_unlock(&buffer->read_mutex);
+    for (i = 0; i < buffer->nr_queues; i++)
+        mutex_unlock(&buffer->queues[i].write_mutex);
+    mutex_unlock(&buffer->write_mutex);
+    return ret;
+}
+
+// Transfers that cross a watermark wake the matching queue with its poll key,
+// so edge-triggered epoll sees every wake-up a blocked reader or writer would.
+static __poll_t dm510_poll(struct file *filep, poll_table *wait) {
+    struct dm510_file *file = filep->private_data;
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *read_buffer = device->read_buffer;
+    struct dm510_buffer *write_buffer = dm510_write_ring(file);
+    __poll_t mask = 0;
+
+    poll_wait(filep, &read_buffer->read_queue, wait);
+    poll_wait(filep, &write_buffer->write_queue, wait);
+
+    if (dm510_readable(file) > 0)
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (ring_poll_writable(file, write_buffer) || ring_lossy(write_buffer))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
+
+static void dm510_latency_sum(struct dm510_device *device, u64 *buckets) {
+    int cpu, b;
+
+    for_each_possible_cpu(cpu) {
+        struct dm510_stats *stats = per_cpu_ptr(device->stats, cpu);
+
+        for (b = 0; b < DM510_LATENCY_BUCKETS; b++)
+            buckets[b] += stats->latency[b];
+    }
+}
+
+static int dm510_stats_show(struct seq_file *s, void *unused) {
+    struct dm510_device *device = s->private;
+    struct dm510_stats sum = {};
+    int cpu, b;
+
+    for_each_possible_cpu(cpu) {
+        struct dm510_stats *stats = per_cpu_ptr(device->stats, cpu);
+
+        sum.bytes_in += stats->bytes_in;
+        sum.bytes_out += stats->bytes_out;
+        sum.reads += stats->reads;
+        sum.writes += stats->writes;
+        sum.eagain += stats->eagain;
+        sum.wait_ns += stats->wait_ns;
+        sum.contended += stats->contended;
+        sum.peak_used = max(sum.peak_used, stats->peak_used);
+        sum.remote_bytes += stats->remote_bytes;
+    }
+
+    seq_printf(s, "bytes_in %llu\n", sum.bytes_in);
+    seq_printf(s, "bytes_out %llu\n", sum.bytes_out);
+    seq_printf(s, "reads %llu\n", sum.reads);
+    seq_printf(s, "writes %llu\n", sum.writes);
+    seq_printf(s, "eagain %llu\n", sum.eagain);
+    seq_printf(s, "wait_ns %llu\n", sum.wait_ns);
+    seq_printf(s, "contended %llu\n", sum.contended);
+    seq_printf(s, "peak_used %llu\n", sum.peak_used);
+    seq_printf(s, "remote_bytes %llu\n", sum.remote_bytes);
+    seq_printf(s, "read_used %zu\n", dm510_used(device->read_buffer));
+    seq_printf(s, "write_used %zu\n", dm510_used(device->write_buffer));
+    seq_printf(s, "write_dropped %llu\n", dm510_dropped(device->write_buffer));
+    seq_printf(s, "queues %u\n", device->write_buffer->nr_queues);
+    seq_printf(s, "write_size %zu\n", device->write_buffer->size);
+    seq_printf(s, "read_node %d\n", READ_ONCE(device->read_buffer->node));
+    seq_printf(s, "write_node %d\n", READ_ONCE(device->write_buffer->node));
+    seq_printf(s, "readers %d\n", atomic_read(&device->readers));
+    seq_printf(s, "writers %d\n", atomic_read(&device->writers));
+
+    // Only the buckets that saw records, named by their exclusive upper bound
+    dm510_latency_sum(device, sum.latency);
+    for (b = 0; b < DM510_LATENCY_BUCKETS - 1; b++) {
+        if (sum.latency[b])
+            seq_printf(s, "latency_ns_%llu %llu\n", 1ULL << b, sum.latency[b]);
+    }
+    if (sum.latency[b])
+        seq_printf(s, "latency_ns_inf %llu\n", sum.latency[b]);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(dm510_stats);
+
+static void dm510_channel_free(struct dm510_channel *channel) {
+    int i;
+
+    for (i = 0; i < DEVICE_COUNT; i++) {
+        debugfs_remove(channel->devices[i].debugfs);
+        free_percpu(channel->devices[i].stats);
+    }
+    for (i = 0; i < BUFFER_COUNT; i++)
+        dm510_buffer_free(&channel->buffers[i]);
+    kmem_cache_free(dm510_channel_cache, channel);
+}
+
+static struct dm510_channel *dm510_channel_alloc(unsigned long index) {
+    struct dm510_channel *channel = kmem_cache_zalloc(dm510_channel_cache, GFP_KERNEL);
+    int node = dm510_numa_node >= 0 ? dm510_numa_node : NUMA_NO_NODE;
+    int i;
+
+    if (!channel)
+        return NULL;
+    channel->index = index;
+    atomic_set(&channel->users, 1);
+    for (i = 0; i < BUFFER_COUNT; i++) {
+        struct dm510_buffer *buffer = &channel->buffers[i];
+
+        buffer->minor = index * DEVICE_COUNT + i; // Written by device i, see below
+        if (nr_queues ? dm510_queues_init(buffer, buffer_size, nr_queues, node) : dm510_buffer_init(buffer, buffer_size, node))
+            goto fail;
+        buffer->rehome = dm510_numa_node == DM510_NUMA_READER;
+    }
+    for (i = 0; i < DEVICE_COUNT; i++) {
+        struct dm510_device *device = &channel->devices[i];
+
+        device->channel = channel;
+        device->minor = index * DEVICE_COUNT + i;
+        device->write_buffer = &channel->buffers[i % BUFFER_COUNT];
+        device->read_buffer = &channel->buffers[(i + 1) % BUFFER_COUNT];
+        atomic_set(&device->readers, 0);
+        atomic_set(&device->writers, 0);
+        init_waitqueue_head(&device->open_queue);
+        device->stats = alloc_percpu(struct dm510_stats);
+        if (!device->stats)
+            goto fail;
+    }
+    return channel;
+
+fail:
+    dm510_channel_free(channel);
+    return NULL;
+}
+
+// Only the channel in dm510_channels has debugfs entries, since a racing
+// open's copy would want the same names. Both are called with
+// dm510_channels_mutex held. Statistics are optional, so debugfs failures
+// are not fatal.
+static void dm510_channel_debugfs(struct dm510_channel *channel) {
+    int i;
+
+    for (i = 0; i < DEVICE_COUNT; i++) {
+        struct dm510_device *device = &channel->devices[i];
+        char name[16];
+
+        snprintf(name, sizeof(name), DEVICE_NAME "-%d", device->minor);
+        device->debugfs = debugfs_create_file(name, 0444, dm510_debugfs, device, &dm510_stats_fops);
+    }
+}
+
+static void dm510_channel_debugfs_remove(struct dm510_channel *channel) {
+    int i;
+
+    for (i = 0; i < DEVICE_COUNT; i++) {
+        debugfs_remove(channel->devices[i].debugfs);
+        channel->devices[i].debugfs = NULL;
+    }
+}
+
+// Look up the channel of a minor and take a reference, creating it if this
+// is the first open. The rings are allocated without the lock held, so a
+// racing open may win; the loser frees its copy and uses the winner's.
+static struct dm510_channel *dm510_channel_get(unsigned long index) {
+    struct dm510_channel *channel, *new;
+    int ret;
+
+    mutex_lock(&dm510_channels_mutex);
+    channel = xa_load(&dm510_channels, index);
+    if (channel)
+        atomic_inc(&channel->users);
+    mutex_unlock(&dm510_channels_mutex);
+    if (channel)
+        return channel;
+
+    new = dm510_channel_alloc(index);
+    if (!new)
+        return ERR_PTR(-ENOMEM);
+
+    mutex_lock(&dm510_channels_mutex);
+    channel = xa_load(&dm510_channels, index);
+    if (channel) {
+        atomic_inc(&channel->users);
+    } else {
+        ret = xa_err(xa_store(&dm510_channels, index, new, GFP_KERNEL));
+        channel = ret ? ERR_PTR(ret) : new;
+        if (!ret) {
+            dm510_channel_debugfs(new);
+            new = NULL;
+        }
+    }
+    mutex_unlock(&dm510_channels_mutex);
+    if (new)
+        dm510_channel_free(new);
+    return channel;
+}
+
+// Data still queued keeps the channel alive, so a writer may close before
+// the reader has opened the other end, and so do settings, so a channel can
+// be configured before its clients start.
+static void dm510_channel_put(struct dm510_channel *channel) {
+    int i;
+
+    if (!atomic_dec_and_mutex_lock(&channel->users, &dm510_channels_mutex))
+        return;
+    if (READ_ONCE(channel->configured)) {
+        mutex_unlock(&dm510_channels_mutex);
+        return;
+    }
+    for (i = 0; i < BUFFER_COUNT; i++) {
+        if (dm510_used(&channel->buffers[i])) {
+            mutex_unlock(&dm510_channels_mutex);
+            return;
+        }
+    }
+    xa_erase(&dm510_channels, channel->index);
+    dm510_channel_debugfs_remove(channel); // The names are free once we unlock
+    mutex_unlock(&dm510_channels_mutex);
+    dm510_channel_free(channel);
+}
+
+// Take a slot if count is below limit. Lock-free, so opens never queue
+// behind each other when there is room.
+static bool dm510_admit(atomic_t *count, int *limit) {
+    int n = atomic_read(count);
+
+    do {
+        int max = READ_ONCE(*limit);
+
+        if (max && n >= max)
+            return false;
+    } while (!atomic_try_cmpxchg(count, &n, n + 1));
+    return true;
+}
+
+// Sleepers give up with EBUSY if open blocking is switched off under them
+static int dm510_admit_wait(struct dm510_device *device, struct file *filep, atomic_t *count, int *limit) {
+    bool admitted;
+
+    if (dm510_admit(count, limit))
+        return 0;
+    if (!READ_ONCE(device->open_blocking) || (filep->f_flags & O_NONBLOCK))
+        return -EBUSY;
+    if (wait_event_interruptible(device->open_queue,
+                                 (admitted = dm510_admit(count, limit)) || !READ_ONCE(device->open_blocking)))
+        return -ERESTARTSYS;
+    return admitted ? 0 : -EBUSY;
+}
+
+static void dm510_admit_release(struct dm510_device *device, atomic_t *count) {
+    atomic_dec(count);
+    if (wq_has_sleeper(&device->open_queue)) // Full barrier, pairs with the wait
+        wake_up_interruptible(&device->open_queue);
+}
+
+// Slots already taken are released if an open can't get all it asked for
+static int dm510_admit_open(struct dm510_device *device, struct file *filep) {
+    int ret;
+
+    if (filep->f_mode & FMODE_READ) {
+        ret = dm510_admit_wait(device, filep, &device->readers, &device->max_readers);
+        if (ret)
+            return ret;
+    }
+    if (filep->f_mode & FMODE_WRITE) {
+        ret = dm510_admit_wait(device, filep, &device->writers, &device->max_writers);
+        if (ret) {
+            if (filep->f_mode & FMODE_READ)
+                dm510_admit_release(device, &device->readers);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int dm510_open(struct inode *inode, struct file *filep) {
+    unsigned int minor = iminor(inode);
+    struct dm510_channel *channel;
+    struct dm510_device *device;
+    struct dm510_file *file;
+    int ret;
+
+    if (minor / DEVICE_COUNT >= max_channels)
+        return -ENXIO;
+    channel = dm510_channel_get(minor / DEVICE_COUNT);
+    if (IS_ERR(channel))
+        return PTR_ERR(channel);
+
+    device = &channel->devices[minor % DEVICE_COUNT];
+    file = kzalloc(sizeof(*file), GFP_KERNEL);
+    ret = file ? dm510_admit_open(device, filep) : -ENOMEM;
+    if (ret) {
+        kfree(file);
+        dm510_channel_put(channel);
+        return ret;
+    }
+    file->device = device;
+    file->read_min = 1;
+    if (device->write_buffer->nr_queues)
+        file->queue = (unsigned int)atomic_inc_return(&device->write_buffer->next_writer) % device->write_buffer->nr_queues;
+    file->spin_ns = (u64)min_t(unsigned int, READ_ONCE(spin_time), MAX_SPIN_TIME) * NSEC_PER_USEC;
+    INIT_LIST_HEAD(&file->reader);
+    // Done once, and a ring that can't move (it is mapped, say) stays put
+    if ((filep->f_mode & FMODE_READ) && READ_ONCE(device->read_buffer->rehome) &&
+        xchg(&device->read_buffer->rehome, 0))
+        dm510_resize(device->read_buffer, device->read_buffer->size, numa_node_id());
+    if (filep->f_mode & FMODE_READ) {
+        // A new broadcast reader starts at the oldest data still queued.
+        // Hubs have no ring of their own and never broadcast.
+        mutex_lock(&device->read_buffer->read_mutex);
+        if (!device->read_buffer->nr_queues)
+            file->cursor = ring_head(device->read_buffer);
+        list_add_tail(&file->reader, &device->read_buffer->readers);
+        mutex_unlock(&device->read_buffer->read_mutex);
+    }
+
+    filep->private_data = file;
+    filep->f_mode |= FMODE_NOWAIT; // read_iter/write_iter honour IOCB_NOWAIT
+    return nonseekable_open(inode, filep);
+}
+
+static int dm510_release(struct inode *inode, struct file *filep) {
+    struct dm510_file *file = filep->private_data;
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer = device->read_buffer;
+    bool wake_writers = false;
+
+    if (filep->f_mode & FMODE_READ) {
+        // The space only this reader still held goes back to the writers
+        mutex_lock(&buffer->read_mutex);
+        list_del(&file->reader);
+        if (buffer->broadcast)
+            wake_writers = ring_reclaim(buffer);
+        mutex_unlock(&buffer->read_mutex);
+        if (wake_writers)
+            ring_wake_writers(buffer);
+        dm510_admit_release(device, &device->readers);
+    }
+    if (filep->f_mode & FMODE_WRITE) {
+        // A record it failed to write without blocking is no longer wanted
+        if (file->write_need)
+            ring_unwant_room(dm510_write_ring(file));
+        dm510_admit_release(device, &device->writers);
+    }
+    dm510_channel_put(device->channel);
+    kfree(file);
+    return 0;
+}
 
-static int dm510_major;
+// A mapping selects its ring by offset, see DM510_MMAP_READ_BUFFER
+static struct dm510_buffer *dm510_vma_buffer(struct vm_area_struct *vma) {
+    struct dm510_device *device = vma->vm_private_data;
 
-struct dm510_buffer {
-    char *data;
-    size_t size;
-    int begin, end, used;
-};
+    return vma->vm_pgoff >= READ_BUFFER_PGOFF ? device->read_buffer : device->write_buffer;
+}
 
-struct dm510_device {
-    struct dm510_buffer buffer;
-    struct mutex mutex;
-    wait_queue_head_t read_queue, write_queue;
-    struct cdev cdev;
+// A mapping pins the channel, since it outlives the file it was made from
+static void dm510_vm_open(struct vm_area_struct *vma) {
+    struct dm510_device *device = vma->vm_private_data;
+
+    atomic_inc(&device->channel->users);
+    atomic_inc(&dm510_vma_buffer(vma)->mmap_count);
+}
+
+static void dm510_vm_close(struct vm_area_struct *vma) {
+    struct dm510_device *device = vma->vm_private_data;
+
+    atomic_dec(&dm510_vma_buffer(vma)->mmap_count);
+    dm510_channel_put(device->channel);
+}
+
+// Page 0 of a mapping is the control page, the data pages follow it
+static vm_fault_t dm510_vm_fault(struct vm_fault *vmf) {
+    struct dm510_buffer *buffer = dm510_vma_buffer(vmf->vma);
+    unsigned long pgoff = vmf->pgoff;
+    struct page *page;
+
+    if (pgoff >= READ_BUFFER_PGOFF)
+        pgoff -= READ_BUFFER_PGOFF;
+
+    if (pgoff == 0)
+        page = virt_to_page(buffer->ctrl);
+    else if (pgoff - 1 < ring_nr_pages(buffer->size))
+        page = buffer->pages[pgoff - 1];
+    else
+        return VM_FAULT_SIGBUS;
+
+    get_page(page);
+    vmf->page = page;
+    return 0;
+}
+
+static const struct vm_operations_struct dm510_vm_ops = {
+    .open = dm510_vm_open,
+    .close = dm510_vm_close,
+    .fault = dm510_vm_fault,
 };
 
-static struct dm510_device devices[DEVICE_COUNT];
+static int dm510_mmap(struct file *filep, struct vm_area_struct *vma) {
+    struct dm510_file *file = filep->private_data;
+    struct dm510_device *device = file->device;
+    unsigned long pgoff = vma->vm_pgoff;
+    struct dm510_buffer *buffer;
 
-static ssize_t dm510_read(struct file *filep, char __user *buf, size_t count, loff_t *f_pos) {
-    struct dm510_device *device = filep->private_data;
-    ssize_t result = 0;
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+    if (pgoff >= READ_BUFFER_PGOFF) {
+        buffer = device->read_buffer;
+        pgoff -= READ_BUFFER_PGOFF;
+    } else {
+        buffer = device->write_buffer;
+    }
+    if (buffer->nr_queues)
+        return -EOPNOTSUPP; // There is no single ring to map
 
-    if (mutex_lock_interruptible(&device->mutex))
-        return -ERESTARTSYS;
+    // Taken so a concurrent SET_BUFFER_SIZE either sees this mapping or
+    // finishes swapping the data pages before the first fault
+    mutex_lock(&buffer->write_mutex);
+    if (pgoff + vma_pages(vma) > 1 + ring_nr_pages(buffer->size)) {
+        mutex_unlock(&buffer->write_mutex);
+        return -EINVAL;
+    }
+    vma->vm_ops = &dm510_vm_ops;
+    vma->vm_private_data = device;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    dm510_vm_open(vma);
+    mutex_unlock(&buffer->write_mutex);
+    return 0;
+}
 
-    // Wait for data to be available
-    while (device->buffer.used == 0) {
-        mutex_unlock(&device->mutex); // Release lock while waiting
-        if (filep->f_flags & O_NONBLOCK)
-            return -EAGAIN; // Non-blocking read
-        if (wait_event_interruptible(device->read_queue, device->buffer.used > 0))
-            return -ERESTARTSYS; // Interrupted while waiting
-        if (mutex_lock_interruptible(&device->mutex))
-            return -ERESTARTSYS;
+static struct file_operations dm510_fops;
+
+// One non-blocking read for a READ_BATCH entry. Entries name fds rather
+// than minors, so the caller must have opened every device it drains and
+// file permissions and admission limits still apply.
+static long dm510_read_one(int fd, void __user *buf, size_t len) {
+    struct fd f = fdget(fd);
+    struct iovec iov;
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    long ret;
+
+    if (!f.file)
+        return -EBADF;
+    if (f.file->f_op != &dm510_fops || !(f.file->f_mode & FMODE_READ)) {
+        ret = -EBADF;
+        goto out;
     }
+    ret = import_single_range(ITER_DEST, buf, len, &iov, &iter);
+    if (ret)
+        goto out;
+    init_sync_kiocb(&kiocb, f.file);
+    kiocb.ki_flags |= IOCB_NOWAIT; // A busy or empty ring is skipped, not waited for
+    ret = dm510_read_iter(&kiocb, &iter);
+    if (ret == -EAGAIN)
+        ret = 0;
+out:
+    fdput(f);
+    return ret;
+}
 
-    // Handle reading with potential wrap-around
-    while (count > 0 && device->buffer.used > 0) {
-        size_t read_chunk = min((size_t)count, (size_t)device->buffer.used);
-        size_t to_end = device->buffer.size - device->buffer.begin; // Distance to the end of the buffer
-        read_chunk = min(read_chunk, to_end);
+static long dm510_read_batch(struct dm510_read_batch __user *ubatch) {
+    struct dm510_read_batch batch;
+    struct dm510_read_desc __user *udescs;
+    struct dm510_read_desc desc;
+    unsigned int i;
+    long filled = 0;
 
-        if (copy_to_user(buf, device->buffer.data + device->buffer.begin, read_chunk)) {
-            result = -EFAULT;
-            break;
-        }
+    if (copy_from_user(&batch, ubatch, sizeof(batch)))
+        return -EFAULT;
+    if (batch.flags || batch.count > DM510_READ_BATCH_MAX)
+        return -EINVAL;
+    udescs = u64_to_user_ptr(batch.descs);
 
-        device->buffer.begin = (device->buffer.begin + read_chunk) % device->buffer.size;
-        device->buffer.used -= read_chunk;
-        result += read_chunk;
-        buf += read_chunk;
-        count -= read_chunk;
+    for (i = 0; i < batch.count; i++) {
+        if (copy_from_user(&desc, &udescs[i], sizeof(desc)))
+            return filled ? filled : -EFAULT;
+        desc.result = dm510_read_one(desc.fd, u64_to_user_ptr(desc.buf), desc.len);
+        if (put_user(desc.result, &udescs[i].result))
+            return filled ? filled : -EFAULT;
+        if (desc.result > 0)
+            filled++;
     }
+    return filled;
+}
 
-    mutex_unlock(&device->mutex);
-    wake_up_interruptible(&device->write_queue); // Wake up any waiting writers
-    return result;
+// Commands are tried once without blocking like any other non-blocking
+// read or write, and only queued if that would have returned -EAGAIN.
+static ssize_t dm510_cmd_rw(struct io_uring_cmd *ioucmd) {
+    struct dm510_cmd *cmd = dm510_cmd_pdu(ioucmd);
+    int dir = ioucmd->cmd_op == DM510_URING_READ ? ITER_DEST : ITER_SOURCE;
+    struct iovec iov;
+    struct iov_iter iter;
+    struct kiocb kiocb;
+    ssize_t ret;
+
+    ret = import_single_range(dir, u64_to_user_ptr(cmd->addr), cmd->len, &iov, &iter);
+    if (ret)
+        return ret;
+    init_sync_kiocb(&kiocb, ioucmd->file);
+    kiocb.ki_flags |= IOCB_NOWAIT;
+    return dir == ITER_DEST ? dm510_read_iter(&kiocb, &iter) : dm510_write_iter(&kiocb, &iter);
 }
 
-static ssize_t dm510_write(struct file *filep, const char __user *buf, size_t count, loff_t *f_pos) {
-    struct dm510_device *device = filep->private_data;
-    ssize_t result = 0;
+// Room a queued write waits for, as a blocked writer would
+static size_t dm510_cmd_need(struct dm510_buffer *buffer, struct dm510_cmd *cmd) {
+    return ring_record_mode(buffer) ? cmd->len + ring_header_size(buffer) : 1;
+}
 
-    if (mutex_lock_interruptible(&device->mutex))
-        return -ERESTARTSYS;
+static struct dm510_cmd_queue *dm510_cmd_queue_of(struct io_uring_cmd *ioucmd) {
+    struct dm510_file *file = ioucmd->file->private_data;
 
-    while (count > 0) {
-        if (device->buffer.used == device->buffer.size) {
-            mutex_unlock(&device->mutex);
-            if (filep->f_flags & O_NONBLOCK)
-                return -EAGAIN;
-            if (wait_event_interruptible(device->write_queue, device->buffer.used < device->buffer.size))
-                return -ERESTARTSYS;
-            if (mutex_lock_interruptible(&device->mutex))
-                return -ERESTARTSYS;
+    if (ioucmd->cmd_op == DM510_URING_READ)
+        return &file->device->read_buffer->read_cmds;
+    return &dm510_write_ring(file)->write_cmds;
+}
+
+// Park a command until the ring it waits for is kicked. It is rechecked
+// once queued, in case the other side went past before it could see it.
+static void dm510_cmd_queue(struct io_uring_cmd *ioucmd) {
+    struct dm510_file *file = ioucmd->file->private_data;
+    struct dm510_cmd_queue *queue = dm510_cmd_queue_of(ioucmd);
+    struct dm510_cmd *cmd = dm510_cmd_pdu(ioucmd);
+    struct dm510_buffer *buffer;
+    bool ready;
+
+    spin_lock(&queue->lock);
+    list_add_tail(&cmd->node, &queue->list);
+    spin_unlock(&queue->lock);
+    smp_mb(); // Pairs with ring_produce() and ring_consume()
+
+    if (ioucmd->cmd_op == DM510_URING_READ) {
+        ready = dm510_readable(file) > 0;
+    } else {
+        buffer = dm510_write_ring(file);
+        ready = ring_writable(buffer, dm510_cmd_need(buffer, cmd));
+        if (!ready)
+            ring_wake_readers(buffer); // See ring_writers_stalled()
+    }
+    if (ready)
+        dm510_cmd_kick(queue);
+}
+
+// Runs in the submitter's task once the command was kicked or cancelled
+static void dm510_cmd_task(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    struct dm510_cmd *cmd = dm510_cmd_pdu(ioucmd);
+    ssize_t ret = 0;
+
+    // An exiting task runs its task work from a kworker without its mm
+    if (!READ_ONCE(cmd->owner) || (current->flags & (PF_EXITING | PF_KTHREAD)))
+        ret = -ECANCELED;
+    if (!ret) {
+        ret = dm510_cmd_rw(ioucmd);
+        if (ret == -EAGAIN) { // Another reader or writer got there first
+            dm510_cmd_queue(ioucmd);
+            return;
         }
+    }
+    io_uring_cmd_done(ioucmd, ret, 0, issue_flags);
+}
+
+// Cancel the commands of filp submitted by process owner, or by anyone if 0
+static int dm510_cmd_cancel_queue(struct dm510_cmd_queue *queue, struct file *filp, pid_t owner) {
+    struct dm510_cmd *cmd, *next;
+    LIST_HEAD(cancelled);
+    int count = 0;
+
+    spin_lock(&queue->lock);
+    list_for_each_entry_safe(cmd, next, &queue->list, node) {
+        if (dm510_cmd_ioucmd(cmd)->file == filp && (!owner || cmd->owner == owner))
+            list_move_tail(&cmd->node, &cancelled);
+    }
+    spin_unlock(&queue->lock);
+
+    list_for_each_entry_safe(cmd, next, &cancelled, node) {
+        list_del_init(&cmd->node);
+        WRITE_ONCE(cmd->owner, 0);
+        io_uring_cmd_complete_in_task(dm510_cmd_ioucmd(cmd), dm510_cmd_task);
+        count++;
+    }
+    return count;
+}
+
+// Only commands that are queued are cancelled. One that was already kicked
+// completes, or is queued again and waits for the next kick.
+static int dm510_cmd_cancel(struct file *filp, pid_t owner) {
+    struct dm510_file *file = filp->private_data;
+
+    return dm510_cmd_cancel_queue(&file->device->read_buffer->read_cmds, filp, owner) +
+           dm510_cmd_cancel_queue(&dm510_write_ring(file)->write_cmds, filp, owner);
+}
 
-        size_t space_left = device->buffer.size - device->buffer.used;
-        size_t to_end = device->buffer.size - device->buffer.end;
-        size_t write_chunk = min(min(count, space_left), to_end);
+// io_uring passthrough, see DM510_URING_READ. A reader can post a batch of
+// buffers and a writer a batch of sends, and reap the completions later,
+// with no thread blocked on the ring.
+static int dm510_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags) {
+    const struct dm510_uring_cmd *ucmd = io_uring_sqe_cmd(ioucmd->sqe);
+    struct dm510_cmd *cmd = dm510_cmd_pdu(ioucmd);
+    fmode_t mode;
+    ssize_t ret;
 
-        if (copy_from_user(device->buffer.data + device->buffer.end, buf + result, write_chunk)) {
-            if (result == 0) // If no bytes were written yet
-                result = -EFAULT; // Only return an error if nothing was written
+    BUILD_BUG_ON(sizeof(struct dm510_cmd) > sizeof(ioucmd->pdu));
+    switch (ioucmd->cmd_op) {
+        case DM510_URING_CANCEL:
+            return dm510_cmd_cancel(ioucmd->file, 0);
+        case DM510_URING_READ:
+            mode = FMODE_READ;
             break;
-        }
+        case DM510_URING_WRITE:
+            mode = FMODE_WRITE;
+            break;
+        default:
+            return -ENOTTY;
+    }
+    if (!(ioucmd->file->f_mode & mode))
+        return -EBADF;
+    if (READ_ONCE(ucmd->flags))
+        return -EINVAL;
+
+    cmd->addr = READ_ONCE(ucmd->addr);
+    cmd->len = READ_ONCE(ucmd->len);
+    // io_uring's SQPOLL and worker threads belong to the process of the ring
+    cmd->owner = current->tgid;
+    ret = dm510_cmd_rw(ioucmd);
+    if (ret != -EAGAIN)
+        return ret;
+    dm510_cmd_queue(ioucmd);
+    return -EIOCBQUEUED;
+}
+
+// Queued commands hold the file, so release can't run until they are gone.
+// flush runs on every close of every copy of the fd, a forked child exiting
+// included, so it only cancels what the closing process submitted.
+static int dm510_flush(struct file *filp, fl_owner_t id) {
+    dm510_cmd_cancel(filp, current->tgid);
+    return 0;
+}
+
+static long dm510_get_latency(struct dm510_device *device, struct dm510_latency __user *ulatency) {
+    struct dm510_latency latency = {};
+
+    dm510_latency_sum(device, latency.buckets);
+    if (copy_to_user(ulatency, &latency, sizeof(latency)))
+        return -EFAULT;
+    return 0;
+}
+
+// Copy out what a non-blocking read would return, without consuming it or
+// waking anyone. Returns 0 if nothing is queued.
+static long dm510_peek(struct dm510_file *file, struct dm510_peek __user *upeek) {
+    struct dm510_buffer *buffer = file->device->read_buffer;
+    struct dm510_peek peek;
+    struct iovec iov;
+    struct iov_iter iter;
+    size_t used;
+    u64 pos;
+    long ret;
 
-        device->buffer.end = (device->buffer.end + write_chunk) % device->buffer.size;
-        device->buffer.used += write_chunk;
-        result += write_chunk;
-        count -= write_chunk;
+    if (copy_from_user(&peek, upeek, sizeof(peek)))
+        return -EFAULT;
+    if (peek.flags)
+        return -EINVAL;
+    if (buffer->nr_queues)
+        return -EOPNOTSUPP; // There is no single next byte to peek at
+    ret = import_single_range(ITER_DEST, u64_to_user_ptr(peek.buf), peek.len, &iov, &iter);
+    if (ret)
+        return ret;
+    if (peek.len == 0)
+        return 0;
+
+    if (mutex_lock_interruptible(&buffer->read_mutex))
+        return -ERESTARTSYS;
+    if (buffer->broadcast) {
+        pos = ring_cursor(buffer, file);
+        used = ring_unread(buffer, file);
+    } else {
+        pos = ring_head(buffer);
+        used = ring_used(buffer);
     }
+    ret = used ? ring_read_at(NULL, buffer, &iter, &pos, used) : 0;
+    mutex_unlock(&buffer->read_mutex);
+    return ret;
+}
 
-    mutex_unlock(&device->mutex);
-    if (device->buffer.used < device->buffer.size)
-        wake_up_interruptible(&device->write_queue); // Wake up any waiting writers
+// Discard up to n queued bytes, or n whole records in record mode, without
+// copying them. Returns how many were discarded.
+static long dm510_skip(struct dm510_file *file, unsigned int n) {
+    struct dm510_buffer *buffer = file->device->read_buffer;
+    size_t used, header, skipped = 0, count = 0;
+    u32 length;
+    u64 pos;
+    bool wake;
 
-    return result; // Return the number of bytes written
+    if (buffer->nr_queues)
+        return -EOPNOTSUPP;
+    if (mutex_lock_interruptible(&buffer->read_mutex))
+        return -ERESTARTSYS;
+    header = ring_header_size(buffer); // Can't change while we hold read_mutex
+    if (buffer->broadcast) {
+        pos = ring_cursor(buffer, file);
+        used = ring_unread(buffer, file);
+    } else {
+        pos = ring_head(buffer);
+        used = ring_used(buffer);
+    }
+    if (!ring_record_mode(buffer)) {
+        skipped = count = min_t(size_t, n, used);
+    } else {
+        while (count < n && used - skipped >= header) {
+            ring_copy_out(buffer, pos + skipped, &length, sizeof(length));
+            if (length > used - skipped - header)
+                break; // Only a misbehaving mmap() producer gets here
+            skipped += header + length;
+            count++;
+        }
+    }
+    if (!skipped)
+        wake = false;
+    else if (buffer->broadcast)
+        wake = ring_advance(buffer, file, pos + skipped);
+    else
+        wake = ring_consume(buffer, pos, skipped);
+    mutex_unlock(&buffer->read_mutex);
+    if (wake)
+        ring_wake_writers(buffer);
+    return count;
 }
 
-static int dm510_open(struct inode *inode, struct file *filep) {
-    int minor = iminor(inode);
-    struct dm510_device *device = &devices[minor];
+// Switching between shared and private cursors can't be done under way, so
+// turning broadcast mode on or off needs this file to be the only reader.
+// Switching between the lag policies can be done at any time.
+static int dm510_set_broadcast(struct dm510_file *file, int mode) {
+    struct dm510_buffer *buffer = file->device->read_buffer;
+    struct dm510_file *other;
+    int ret = 0;
 
-    filep->private_data = device;
-    return nonseekable_open(inode, filep);
+    if (mode < DM510_BROADCAST_OFF || mode > DM510_BROADCAST_DROP)
+        return -EINVAL;
+    if (buffer->nr_queues)
+        return -EOPNOTSUPP;
+    // Opens add themselves to readers under read_mutex, so none can slip by
+    mutex_lock(&buffer->read_mutex);
+    if (!buffer->broadcast != !mode) {
+        list_for_each_entry(other, &buffer->readers, reader) {
+            if (other != file) {
+                ret = -EBUSY;
+                goto unlock;
+            }
+        }
+        file->cursor = ring_head(buffer);
+    }
+    WRITE_ONCE(buffer->broadcast, mode);
+unlock:
+    mutex_unlock(&buffer->read_mutex);
+    if (!ret)
+        ring_wake_writers(buffer); // A blocked writer may now drop instead
+    return ret;
 }
 
-static int dm510_release(struct inode *inode, struct file *filep) {
+// Attach the eventfd behind fd to a doorbell, replacing any previous one,
+// or detach it with fd -1
+static int dm510_set_doorbell(struct eventfd_ctx __rcu **slot, int fd) {
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd != -1) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+    old = unrcu_pointer(xchg(slot, RCU_INITIALIZER(ctx)));
+    if (old) {
+        synchronize_rcu(); // Let anyone still ringing it finish
+        eventfd_ctx_put(old);
+    }
     return 0;
 }
 
+// Commands that change the settings of a device or its rings rather than
+// of one open file, which keep the channel from being reclaimed
+static bool dm510_ioctl_configures(unsigned int cmd) {
+    switch (cmd) {
+        case SET_BUFFER_SIZE:
+        case SET_MAX_NR_PROCESSES:
+        case SET_MAX_NR_READERS:
+        case SET_READ_WATERMARK:
+        case SET_WRITE_WATERMARK:
+        case SET_WATERMARK_TIMEOUT:
+        case SET_RECORD_MODE:
+        case SET_MAX_NR_WRITERS:
+        case SET_OPEN_BLOCKING:
+        case SET_READ_EVENTFD:
+        case SET_WRITE_EVENTFD:
+        case SET_BROADCAST:
+        case SET_OVERWRITE:
+        case SET_NUMA_NODE:
+            return true;
+        default:
+            return false;
+    }
+}
+
 static long dm510_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
-    struct dm510_device *device = filp->private_data;
+    struct dm510_file *file = filp->private_data;
+    struct dm510_device *device = file->device;
+    struct dm510_buffer *buffer;
     long retval = 0;
     int tmp;
     size_t free_space, used_space;
+    unsigned long long dropped;
+    unsigned int i;
 
     switch (cmd) {
         case GET_BUFFER_SIZE:
-            if (copy_to_user((int __user *)arg, &device->buffer.size, sizeof(device->buffer.size)))
+            if (copy_to_user((int __user *)arg, &device->write_buffer->size, sizeof(device->write_buffer->size)))
                 return -EFAULT;
             break;
 
@@ -142,109 +2236,356 @@ static long dm510_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
                 return -EFAULT;
             if (tmp < 1 || tmp > MAX_BUFFER_SIZE)
                 return -EINVAL;
-            mutex_lock(&device->mutex);
-            kfree(device->buffer.data);
-            device->buffer.data = kmalloc(tmp, GFP_KERNEL);
-            if (!device->buffer.data) {
-                retval = -ENOMEM;
-                break;
-            }
-            device->buffer.size = tmp;
-            device->buffer.begin = 0;
-            device->buffer.end = 0;
-            device->buffer.used = 0;
-            mutex_unlock(&device->mutex);
+            retval = dm510_resize(device->write_buffer, tmp, READ_ONCE(device->write_buffer->node));
             break;
 
-        case GET_MAX_NR_PROCESSES:
-            // This example assumes a fixed limit; modify as needed
-            tmp = DEVICE_COUNT;
+        case GET_MAX_NR_PROCESSES: // Only reachable as GET_MAX_NR_READERS, see ioctl_commands.h
+        case GET_MAX_NR_READERS:
+            tmp = device->max_readers;
             if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
                 return -EFAULT;
             break;
 
         case SET_MAX_NR_PROCESSES:
-            // Ignored or log a warning; typically, this is not dynamically adjustable but fixed
-            printk(KERN_WARNING "DM510: SET_MAX_NR_PROCESSES not supported.\n");
+        case SET_MAX_NR_READERS:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0)
+                return -EINVAL;
+            // Lowering the limit doesn't evict anyone, it only stops new opens
+            WRITE_ONCE(device->max_readers, tmp);
+            wake_up_interruptible(&device->open_queue);
             break;
 
         case GET_BUFFER_FREE_SPACE:
-            mutex_lock(&device->mutex);
-            free_space = device->buffer.size - device->buffer.used;
-            mutex_unlock(&device->mutex);
+            buffer = dm510_write_ring(file);
+            free_space = buffer->size - ring_used(buffer);
             if (copy_to_user((size_t __user *)arg, &free_space, sizeof(free_space)))
                 return -EFAULT;
             break;
 
         case GET_BUFFER_USED_SPACE:
-            mutex_lock(&device->mutex);
-            used_space = device->buffer.used;
-            mutex_unlock(&device->mutex);
+            used_space = dm510_used(device->read_buffer);
             if (copy_to_user((size_t __user *)arg, &used_space, sizeof(used_space)))
                 return -EFAULT;
             break;
 
+        case WAKE_BUFFER_WAITERS:
+            // A peer working on an mmap()ed control page doesn't go through
+            // read/write, so it has to tell us when it moved the indices
+            ring_wake_readers(device->write_buffer);
+            ring_wake_writers(device->read_buffer);
+            ring_doorbell(&device->write_buffer->read_doorbell);
+            ring_doorbell(&device->read_buffer->write_doorbell);
+            break;
+
+        case GET_READ_WATERMARK:
+            tmp = device->read_buffer->read_watermark;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_READ_WATERMARK:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 1 || tmp > MAX_BUFFER_SIZE)
+                return -EINVAL;
+            if (device->read_buffer->nr_queues)
+                return -EOPNOTSUPP; // Sub-rings would each apply it on their own
+            WRITE_ONCE(device->read_buffer->read_watermark, tmp);
+            ring_wake_readers(device->read_buffer); // Wake-ups only come on crossings
+            break;
+
+        case GET_WRITE_WATERMARK:
+            tmp = device->write_buffer->write_watermark;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_WRITE_WATERMARK:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 1 || tmp > MAX_BUFFER_SIZE)
+                return -EINVAL;
+            if (device->write_buffer->nr_queues)
+                return -EOPNOTSUPP; // Sub-rings would each apply it on their own
+            WRITE_ONCE(device->write_buffer->write_watermark, tmp);
+            ring_wake_writers(device->write_buffer);
+            break;
+
+        case GET_WATERMARK_TIMEOUT:
+            tmp = jiffies_to_msecs(device->read_buffer->read_timeout);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_WATERMARK_TIMEOUT:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0)
+                return -EINVAL;
+            if (device->read_buffer->nr_queues)
+                return -EOPNOTSUPP;
+            WRITE_ONCE(device->read_buffer->read_timeout, msecs_to_jiffies(tmp));
+            break;
+
+        case GET_RECORD_MODE:
+            if (!device->write_buffer->record_mode)
+                tmp = DM510_RECORD_MODE_OFF;
+            else if (!device->write_buffer->timestamps)
+                tmp = DM510_RECORD_MODE_ON;
+            else
+                tmp = DM510_RECORD_MODE_TIMESTAMPED;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_RECORD_MODE:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < DM510_RECORD_MODE_OFF || tmp > DM510_RECORD_MODE_TIMESTAMPED)
+                return -EINVAL;
+            retval = dm510_set_record_mode(device->write_buffer, tmp);
+            break;
+
+        case READ_BATCH:
+            retval = dm510_read_batch((struct dm510_read_batch __user *)arg);
+            break;
+
+        case GET_MAX_NR_WRITERS:
+            tmp = device->max_writers;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_MAX_NR_WRITERS:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0)
+                return -EINVAL;
+            WRITE_ONCE(device->max_writers, tmp);
+            wake_up_interruptible(&device->open_queue);
+            break;
+
+        case GET_OPEN_BLOCKING:
+            tmp = device->open_blocking;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_OPEN_BLOCKING:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            WRITE_ONCE(device->open_blocking, tmp != 0);
+            wake_up_interruptible(&device->open_queue);
+            break;
+
+        case GET_SPIN_TIME:
+            tmp = div_u64(file->spin_ns, NSEC_PER_USEC);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_SPIN_TIME:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0 || tmp > MAX_SPIN_TIME)
+                return -EINVAL;
+            WRITE_ONCE(file->spin_ns, (u64)tmp * NSEC_PER_USEC);
+            break;
+
+        case GET_READ_MIN:
+            tmp = file->read_min;
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_READ_MIN:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 1 || tmp > MAX_BUFFER_SIZE)
+                return -EINVAL;
+            WRITE_ONCE(file->read_min, tmp);
+            break;
+
+        case GET_READ_TIME:
+            tmp = jiffies_to_msecs(file->read_time);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_READ_TIME:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0)
+                return -EINVAL;
+            WRITE_ONCE(file->read_time, msecs_to_jiffies(tmp));
+            break;
+
+        case PEEK:
+            if (!(filp->f_mode & FMODE_READ))
+                return -EBADF;
+            return dm510_peek(file, (struct dm510_peek __user *)arg);
+
+        case SKIP:
+            if (!(filp->f_mode & FMODE_READ))
+                return -EBADF;
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp < 0)
+                return -EINVAL;
+            return dm510_skip(file, tmp);
+
+        case GET_BROADCAST:
+            tmp = READ_ONCE(device->read_buffer->broadcast);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_BROADCAST:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            retval = dm510_set_broadcast(file, tmp);
+            break;
+
+        case GET_DROPPED:
+            dropped = READ_ONCE(device->read_buffer->broadcast) ? READ_ONCE(file->dropped) :
+                                                                  dm510_dropped(device->read_buffer);
+            if (copy_to_user((unsigned long long __user *)arg, &dropped, sizeof(dropped)))
+                return -EFAULT;
+            break;
+
+        case GET_OVERWRITE:
+            tmp = READ_ONCE(device->write_buffer->overwrite);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_OVERWRITE:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            WRITE_ONCE(device->write_buffer->overwrite, tmp != 0);
+            ring_wake_writers(device->write_buffer); // Blocked writers may drop now
+            for (i = 0; i < device->write_buffer->nr_queues; i++)
+                ring_wake_writers(&device->write_buffer->queues[i]);
+            break;
+
+        case GET_NUMA_NODE:
+            tmp = READ_ONCE(device->read_buffer->node);
+            if (copy_to_user((int __user *)arg, &tmp, sizeof(tmp)))
+                return -EFAULT;
+            break;
+
+        case SET_NUMA_NODE:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            if (tmp == DM510_NUMA_READER) {
+                WRITE_ONCE(device->read_buffer->rehome, 1);
+                break;
+            }
+            if (tmp < 0 || tmp >= MAX_NUMNODES || !node_online(tmp))
+                return -EINVAL;
+            buffer = device->read_buffer;
+            retval = dm510_resize(buffer, READ_ONCE(buffer->size), tmp);
+            break;
+
+        case GET_LATENCY_HISTOGRAM:
+            return dm510_get_latency(device, (struct dm510_latency __user *)arg);
+
+        case SET_READ_EVENTFD:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            retval = dm510_set_doorbell(&device->read_buffer->read_doorbell, tmp);
+            break;
+
+        case SET_WRITE_EVENTFD:
+            if (copy_from_user(&tmp, (int __user *)arg, sizeof(tmp)))
+                return -EFAULT;
+            retval = dm510_set_doorbell(&device->write_buffer->write_doorbell, tmp);
+            break;
+
         default:
             return -ENOTTY;
     }
 
+    if (!retval && dm510_ioctl_configures(cmd))
+        WRITE_ONCE(device->channel->configured, true);
     return retval;
 }
 
 // File operations structure
 static struct file_operations dm510_fops = {
     .owner = THIS_MODULE,
-    .read = dm510_read,
-    .write = dm510_write,
+    .read_iter = dm510_read_iter,
+    .write_iter = dm510_write_iter,
+    // The ring pages are reused as soon as they are consumed, so they can't
+    // be lent to a pipe. Both directions do one in-kernel copy through the
+    // iter paths instead, which keeps record framing and wake-ups intact.
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
+    .poll = dm510_poll,
     .open = dm510_open,
     .release = dm510_release,
     .unlocked_ioctl = dm510_ioctl,
+    .mmap = dm510_mmap,
+    .uring_cmd = dm510_uring_cmd,
+    .flush = dm510_flush,
 };
 
 static int __init dm510_init_module(void) {
     dev_t dev_num;
-    int i, ret;
+    int ret;
+
+    if (max_channels < 1 || max_channels > MAX_CHANNELS ||
+        buffer_size < 1 || buffer_size > MAX_BUFFER_SIZE || nr_queues > MAX_QUEUES)
+        return -EINVAL;
+    if (dm510_numa_node < DM510_NUMA_READER || (dm510_numa_node >= 0 && (dm510_numa_node >= MAX_NUMNODES || !node_online(dm510_numa_node))))
+        return -EINVAL;
 
-    ret = alloc_chrdev_region(&dev_num, MIN_MINOR_NUMBER, DEVICE_COUNT, DEVICE_NAME);
+    ret = alloc_chrdev_region(&dev_num, MIN_MINOR_NUMBER, max_channels * DEVICE_COUNT, DEVICE_NAME);
     if (ret < 0) {
         printk(KERN_WARNING "DM510: Can't allocate device number\n");
         return ret;
     }
     dm510_major = MAJOR(dev_num);
 
-    for (i = 0; i < DEVICE_COUNT; i++) {
-        cdev_init(&devices[i].cdev, &dm510_fops);
-        devices[i].cdev.owner = THIS_MODULE;
-        mutex_init(&devices[i].mutex);
-        init_waitqueue_head(&devices[i].read_queue);
-        init_waitqueue_head(&devices[i].write_queue);
-        devices[i].buffer.data = kmalloc(MAX_BUFFER_SIZE, GFP_KERNEL);
-        devices[i].buffer.size = MAX_BUFFER_SIZE;
-        devices[i].buffer.begin = 0;
-        devices[i].buffer.end = 0;
-        devices[i].buffer.used = 0;
-        ret = cdev_add(&devices[i].cdev, MKDEV(dm510_major, i), 1);
-        if (ret) {
-            printk(KERN_NOTICE "DM510: Error %d adding dm510-%d", ret, i);
-            for (--i; i >= 0; i--) {
-                cdev_del(&devices[i].cdev);
-            }
-            unregister_chrdev_region(MKDEV(dm510_major, 0), DEVICE_COUNT);
-            return ret;
-        }
+    dm510_channel_cache = KMEM_CACHE(dm510_channel, SLAB_HWCACHE_ALIGN);
+    if (!dm510_channel_cache) {
+        unregister_chrdev_region(dev_num, max_channels * DEVICE_COUNT);
+        return -ENOMEM;
+    }
+
+    // Statistics are optional, so debugfs failures are not fatal
+    dm510_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+
+    // One cdev covers every minor, channels are looked up on open
+    cdev_init(&dm510_cdev, &dm510_fops);
+    dm510_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&dm510_cdev, dev_num, max_channels * DEVICE_COUNT);
+    if (ret) {
+        printk(KERN_NOTICE "DM510: Error %d adding devices", ret);
+        debugfs_remove_recursive(dm510_debugfs);
+        kmem_cache_destroy(dm510_channel_cache);
+        unregister_chrdev_region(dev_num, max_channels * DEVICE_COUNT);
+        return ret;
     }
-    printk(KERN_INFO "DM510: Module loaded with device major number %d\n", dm510_major);
+
+    printk(KERN_INFO "DM510: Module loaded with device major number %d, %u channels\n", dm510_major, max_channels);
     return 0;
 }
 
 static void __exit dm510_cleanup_module(void) {
-    int i;
-    for (i = 0; i < DEVICE_COUNT; i++) {
-        if (devices[i].buffer.data)
-            kfree(devices[i].buffer.data);
-        cdev_del(&devices[i].cdev);
-    }
-    unregister_chrdev_region(MKDEV(dm510_major, 0), DEVICE_COUNT);
+    struct dm510_channel *channel;
+    unsigned long index;
+
+    cdev_del(&dm510_cdev);
+    // Only channels still holding data or settings are left, nothing has them open
+    xa_for_each(&dm510_channels, index, channel)
+        dm510_channel_free(channel);
+    xa_destroy(&dm510_channels);
+    kmem_cache_destroy(dm510_channel_cache);
+    debugfs_remove_recursive(dm510_debugfs);
+    unregister_chrdev_region(MKDEV(dm510_major, 0), max_channels * DEVICE_COUNT);
     printk(KERN_INFO "DM510: Module unloaded\n");
 }
 
@@ -0,0 +1,121 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dm510
+
+#if !defined(_DM510_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _DM510_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Static tracepoints on the hot paths, under events/dm510/ in tracefs. They
+// cost a patched-out branch while disabled, so they are cheap enough to leave
+// in production and hang eBPF histograms off. minor is the device doing the
+// transfer or waiting; ring is the minor of the device writing into a ring.
+
+// A read or write moved bytes; used is what the ring holds afterwards
+DECLARE_EVENT_CLASS(dm510_transfer,
+    TP_PROTO(int minor, size_t bytes, size_t used),
+    TP_ARGS(minor, bytes, used),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(size_t, bytes)
+        __field(size_t, used)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->bytes = bytes;
+        __entry->used = used;
+    ),
+    TP_printk("minor=%d bytes=%zu used=%zu", __entry->minor, __entry->bytes, __entry->used)
+);
+
+DEFINE_EVENT(dm510_transfer, dm510_enqueue,
+    TP_PROTO(int minor, size_t bytes, size_t used),
+    TP_ARGS(minor, bytes, used)
+);
+
+DEFINE_EVENT(dm510_transfer, dm510_dequeue,
+    TP_PROTO(int minor, size_t bytes, size_t used),
+    TP_ARGS(minor, bytes, used)
+);
+
+// A reader or writer spun and slept for ns waiting for need bytes of data or room
+TRACE_EVENT(dm510_block,
+    TP_PROTO(int minor, bool write, size_t need, u64 ns),
+    TP_ARGS(minor, write, need, ns),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(bool, write)
+        __field(size_t, need)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->write = write;
+        __entry->need = need;
+        __entry->ns = ns;
+    ),
+    TP_printk("minor=%d %s need=%zu ns=%llu", __entry->minor, __entry->write ? "write" : "read",
+              __entry->need, __entry->ns)
+);
+
+// A read or write found a ring mutex held and waited ns for it
+TRACE_EVENT(dm510_lock_wait,
+    TP_PROTO(int minor, u64 ns),
+    TP_ARGS(minor, ns),
+    TP_STRUCT__entry(
+        __field(int, minor)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ns = ns;
+    ),
+    TP_printk("minor=%d ns=%llu", __entry->minor, __entry->ns)
+);
+
+// Readers or writers of a ring were woken with used bytes queued
+TRACE_EVENT(dm510_wake,
+    TP_PROTO(int ring, bool writers, size_t used),
+    TP_ARGS(ring, writers, used),
+    TP_STRUCT__entry(
+        __field(int, ring)
+        __field(bool, writers)
+        __field(size_t, used)
+    ),
+    TP_fast_assign(
+        __entry->ring = ring;
+        __entry->writers = writers;
+        __entry->used = used;
+    ),
+    TP_printk("ring=%d %s used=%zu", __entry->ring, __entry->writers ? "writers" : "readers",
+              __entry->used)
+);
+
+// A ring, or one sub-ring of it, was resized; ret is 0 or the error
+TRACE_EVENT(dm510_resize,
+    TP_PROTO(int ring, size_t old_size, size_t size, int ret),
+    TP_ARGS(ring, old_size, size, ret),
+    TP_STRUCT__entry(
+        __field(int, ring)
+        __field(size_t, old_size)
+        __field(size_t, size)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->ring = ring;
+        __entry->old_size = old_size;
+        __entry->size = size;
+        __entry->ret = ret;
+    ),
+    TP_printk("ring=%d old_size=%zu size=%zu ret=%d", __entry->ring, __entry->old_size,
+              __entry->size, __entry->ret)
+);
+
+#endif /* _DM510_TRACE_H */
+
+// This header lives outside include/trace/events, see CFLAGS_dm510_dev.o
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dm510_trace
+#include <trace/define_trace.h>
@@ -1,16 +1,215 @@
 #ifndef IOCTL_COMMANDS
 #define IOCTL_COMMANDS
 
-//Defined command codes for ioctl operations
+//Defined command codes for ioctl operations. New commands must not reuse a number the VFS
+//handles itself before the driver sees it, such as FIGETBSZ (2) or FIONBIO
+//Each device reads from one buffer and writes into the other, so buffer size and
+//free space refer to the buffer the device writes into, and used space to the one it reads from
 #define GET_BUFFER_SIZE 0   //Command to get current size of the buffer in bytes
-#define SET_BUFFER_SIZE 1  //Command to set a new size for the buffer in bytes
-#define GET_MAX_NR_PROCESSES 2  //Command to get maximum number of processes allowed to acess the device
-#define SET_MAX_NR_PROCESSES 3  //Command to set maximum number of processes allowed to acess the device
+#define SET_BUFFER_SIZE 1  //Command to set a new size for the buffer in bytes, keeping queued data (EBUSY if it does not fit or the buffer is mmap()ed)
+#define GET_MAX_NR_PROCESSES 2  //Never reaches the driver: 2 is FIGETBSZ, which the VFS answers first. Use GET_MAX_NR_READERS
+#define SET_MAX_NR_PROCESSES 3  //Command to set maximum number of processes allowed to read from the device, 0 is unlimited
 #define GET_BUFFER_FREE_SPACE 4  //Command to query the amount of free space in the device buffer
 #define GET_BUFFER_USED_SPACE 5  //Command to query the aomunt of used space in the device buffer
+#define WAKE_BUFFER_WAITERS 6  //Command to wake blocked readers and writers after updating an mmap()ed control page
+
+//Wake-up watermarks, in bytes. Blocked readers are only woken once the used space of the
+//buffer the device reads from reaches the read watermark, or the watermark timeout expires.
+//Blocked writers are only woken once the free space of the buffer the device writes into
+//reaches the write watermark. Both default to 1, which wakes on every transfer
+#define GET_READ_WATERMARK 7  //Command to get the read watermark
+#define SET_READ_WATERMARK 8  //Command to set the read watermark
+#define GET_WRITE_WATERMARK 9  //Command to get the write watermark
+#define SET_WRITE_WATERMARK 10  //Command to set the write watermark
+#define GET_WATERMARK_TIMEOUT 11  //Command to get how long readers wait for the read watermark in ms, 0 is forever
+#define SET_WATERMARK_TIMEOUT 12  //Command to set how long readers wait for the read watermark in ms, 0 is forever
+
+//Record mode of the buffer the device writes into. In record mode every write is stored as
+//one record and every read returns one or more whole records, or fails with EMSGSIZE if the
+//first one does not fit. Readers follow the mode of the buffer they read from. The mode can
+//only be changed while the buffer is empty (EBUSY otherwise)
+#define GET_RECORD_MODE 13  //Command to get the record mode, one of DM510_RECORD_MODE_*
+#define SET_RECORD_MODE 14  //Command to set the record mode, one of DM510_RECORD_MODE_*
+
+#define DM510_RECORD_MODE_OFF 0  //Stream mode
+#define DM510_RECORD_MODE_ON 1  //Record mode
+#define DM510_RECORD_MODE_TIMESTAMPED 2  //Record mode, each record also stamped with the time it was written
+
+//Admission limits. Opening the device for reading counts against the reader limit of the
+//buffer it reads from, opening it for writing against the writer limit of the buffer it
+//writes into. Opens past a limit fail with EBUSY, or sleep until a slot frees if open
+//blocking is enabled on the device and the open is not O_NONBLOCK
+#define GET_MAX_NR_WRITERS 15  //Command to get maximum number of processes allowed to write to the device, 0 is unlimited
+#define SET_MAX_NR_WRITERS 16  //Command to set maximum number of processes allowed to write to the device, 0 is unlimited
+#define GET_OPEN_BLOCKING 17  //Command to get whether opens past a limit sleep, 1 if enabled
+#define SET_OPEN_BLOCKING 18  //Command to make opens past a limit sleep (1) or fail with EBUSY (0)
+#define GET_MAX_NR_READERS 38  //Command to get maximum number of processes allowed to read from the device, 0 is unlimited
+#define SET_MAX_NR_READERS 39  //Same as SET_MAX_NR_PROCESSES
+
+//Batched read. Takes a struct dm510_read_batch and reads from every dm510 fd it lists without
+//blocking, as read() would on each. Returns the number of entries that got data. Issued on
+//any open dm510 device; the fds must be open for reading. Use poll() to wait for data
+#define READ_BATCH 19  //Command to read from several devices in one call
+
+//Low-latency mode of the open file. Before sleeping on an empty or full buffer, reads and
+//writes on this file busy-poll it for up to the spin time, in microseconds (at most 1000).
+//New files start with the spin_time module parameter, 0 by default, which sleeps at once
+#define GET_SPIN_TIME 20  //Command to get the spin time of this file
+#define SET_SPIN_TIME 21  //Command to set the spin time of this file
+
+//Minimum fill of the open file, like termios VMIN/VTIME. A blocking read still waits for the
+//first byte as before, then keeps waiting until read min bytes (or as many as the read asked
+//for) are queued or the read time runs out, and returns what is there. The defaults of 1 byte
+//and 0 ms return as soon as anything is queued. Non-blocking reads never wait
+#define GET_READ_MIN 22  //Command to get the minimum number of bytes a read waits for
+#define SET_READ_MIN 23  //Command to set the minimum number of bytes a read waits for
+#define GET_READ_TIME 24  //Command to get how long a read waits for the minimum in ms, 0 is forever
+#define SET_READ_TIME 25  //Command to set how long a read waits for the minimum in ms, 0 is forever
+
+//Doorbells for peers working on an mmap()ed buffer. Each takes an eventfd, or -1 to detach it.
+//The read eventfd is signalled when the buffer the device reads from stops being empty, the
+//write eventfd when the buffer it writes into stops being full, and both on WAKE_BUFFER_WAITERS
+//from the other side. They stay attached until replaced or the module is unloaded
+#define SET_READ_EVENTFD 26  //Command to attach an eventfd signalled when there is data to read
+#define SET_WRITE_EVENTFD 27  //Command to attach an eventfd signalled when there is room to write
+
+//Non-consuming reads, like MSG_PEEK. PEEK takes a struct dm510_peek and copies out what a
+//non-blocking read() would return, without consuming it or waking writers. It returns the
+//number of bytes copied, 0 if the buffer is empty. SKIP takes an int n and discards up to n
+//bytes, or up to n whole records in record mode, without copying them. It returns how many
+//were discarded. Neither ever waits, and neither is supported in multi-queue mode
+#define PEEK 28  //Command to copy out queued data without consuming it
+#define SKIP 29  //Command to discard queued data without copying it
+
+//Broadcast mode of the buffer the device reads from, one of DM510_BROADCAST_*. In broadcast
+//mode every open file reading from the device sees every byte written, from a position of its
+//own, and PEEK and SKIP work on that position too. New readers start at the oldest data still
+//queued. Space is only freed once the slowest reader is past it: with DM510_BROADCAST_BLOCK
+//writers wait for it, with DM510_BROADCAST_DROP they drop the oldest data instead, and readers
+//that still wanted it skip ahead. Turning broadcast mode on or off fails with EBUSY while any
+//other file has the device open for reading. Watermarks, read min and spin time do not apply
+//to broadcast reads, and it is not supported in multi-queue mode. A consumer on an mmap()ed
+//control page must not move head while broadcast mode is on
+#define GET_BROADCAST 30  //Command to get the broadcast mode
+#define SET_BROADCAST 31  //Command to set the broadcast mode
+#define GET_DROPPED 32  //Command to get the bytes lost by readers, as an unsigned long long, see below
+
+#define DM510_BROADCAST_OFF 0  //Each byte goes to one reader
+#define DM510_BROADCAST_BLOCK 1  //Every reader sees every byte, writers wait for the slowest
+#define DM510_BROADCAST_DROP 2  //Every reader sees every byte unless it lags a full buffer behind
+
+//Overwrite mode of the buffer the device writes into, for producers that must never stall.
+//A write that finds the buffer full drops the oldest data to make room, whole records in record
+//mode, so it never waits for a reader to free space. Dropping has to wait for a read that is
+//copying out to finish, and a non-blocking write fails with EAGAIN instead while one is. GET_DROPPED
+//on the reading device returns how many bytes were dropped so far; in broadcast mode it returns
+//what that file lost instead
+#define GET_OVERWRITE 33  //Command to get the overwrite mode, 1 if enabled
+#define SET_OVERWRITE 34  //Command to enable (1) or disable (0) overwrite mode
+
+//NUMA node holding the buffer the device reads from, so its consumer can be pinned next to it.
+//Setting a node moves the queued data to pages on that node, and fails with EBUSY while the
+//buffer is mmap()ed. DM510_NUMA_READER instead moves it to the node of the next file that opens
+//the device for reading. The numa_node module parameter sets the node of new channels, and
+//remote_bytes in debugfs counts bytes copied on a CPU of another node than the buffer
+#define GET_NUMA_NODE 35  //Command to get the NUMA node of the buffer the device reads from
+#define SET_NUMA_NODE 36  //Command to move the buffer the device reads from to a NUMA node
+
+#define DM510_NUMA_ANY -1  //Module parameter only: the node of the CPU that first opens the channel
+#define DM510_NUMA_READER -2  //The node of the next reader to open the device
+
+//End-to-end latency of timestamped records: the time from a write publishing a record to a read
+//taking it, summed into a histogram of the device that read it. Bucket b counts latencies below
+//2^b ns that did not fit bucket b - 1, the last bucket everything longer. PEEK does not count.
+//debugfs lists the buckets that are not empty as latency_ns_<2^b>
+#define GET_LATENCY_HISTOGRAM 37  //Command to get the latency histogram, struct dm510_latency
+
+#define DM510_LATENCY_BUCKETS 40  //Up to 2^38 ns, about 275 s, before the last bucket
 
 //Defined constants for our device managment 
-#define DEVICE_COUNT 2  //The number of devices manged by the driver
-#define BUFFER_COUNT 2  //The Number of buffers associated with each device
+//A channel gets its buffers on the first open of one of its devices. Once no file has it open or
+//mapped and its buffers are empty it is freed again, unless a device or buffer setting was changed
+//by an ioctl: then it is kept as it is, so it can be configured before its readers and writers open
+#define DEVICE_COUNT 2  //The number of devices in a channel, minor m belongs to channel m / DEVICE_COUNT
+#define BUFFER_COUNT 2  //The Number of buffers shared by the devices of a channel, one per direction
+
+//Multi-queue mode (nr_queues module parameter): every buffer is split into that many sub-rings
+//of the buffer size each. Each open file writes into one sub-ring; reads drain them round-robin,
+//so ordering only holds between writes on the same file. Free space refers to the sub-ring of
+//the file, used space to all of them. Read min only applies to single rings. Setting a watermark
+//or the watermark timeout fails with EOPNOTSUPP, and so does mmap()
+
+//mmap() offsets of the two buffers of a device. Each mapping starts with one
+//control page holding struct dm510_ring_ctrl, followed by the buffer data pages
+#define DM510_MMAP_WRITE_BUFFER 0x00000000UL  //The buffer the device writes into
+#define DM510_MMAP_READ_BUFFER 0x80000000UL  //The buffer the device reads from
+
+//Control page of a buffer. head and tail are free-running byte counts that never wrap:
+//the bytes queued are tail - head, and position p lives at offset p % size of the buffer
+//data, or p & (size - 1) when size is a power of two. A producer copies data in at tail and
+//then stores the new tail; a consumer copies data out at head and then stores the new head.
+//Stores must have release ordering and loads of the other side's counter acquire ordering.
+//Each counter has a cache line of its own, so the two sides never write to the same line
+#define DM510_CACHELINE_SIZE 64
+
+struct dm510_ring_ctrl {
+    int size;  //Size of the buffer data in bytes, read only
+    unsigned long long head __attribute__((aligned(DM510_CACHELINE_SIZE)));  //Bytes consumed so far, owned by the consumer
+    unsigned long long tail __attribute__((aligned(DM510_CACHELINE_SIZE)));  //Bytes produced so far, owned by the producer
+};
+
+//In record mode each record in the buffer data is preceded by its length in bytes,
+//stored as a 32 bit unsigned int that may wrap around the end of the buffer like the payload
+#define DM510_RECORD_HEADER_SIZE 4
+
+//With DM510_RECORD_MODE_TIMESTAMPED the length is followed by the CLOCK_MONOTONIC time in ns the
+//record was written at, a 64 bit unsigned int, so the payload starts DM510_RECORD_HEADER_SIZE +
+//DM510_RECORD_TIMESTAMP_SIZE bytes into the record. An mmap() producer has to fill it in too
+#define DM510_RECORD_TIMESTAMP_SIZE 8
+
+//One entry of a READ_BATCH call
+struct dm510_read_desc {
+    int fd;  //Open dm510 device to read from
+    unsigned int len;  //Size of buf in bytes
+    unsigned long long buf;  //User buffer, cast from a pointer
+    long long result;  //Set to the bytes read, 0 if nothing was queued, or a negative errno
+};
+
+struct dm510_read_batch {
+    unsigned long long descs;  //Array of struct dm510_read_desc, cast from a pointer
+    unsigned int count;  //Number of entries, at most DM510_READ_BATCH_MAX
+    unsigned int flags;  //Must be 0
+};
+
+#define DM510_READ_BATCH_MAX 1024
+
+//Argument of PEEK
+struct dm510_peek {
+    unsigned long long buf;  //User buffer, cast from a pointer
+    unsigned int len;  //Size of buf in bytes
+    unsigned int flags;  //Must be 0
+};
+
+//io_uring passthrough (IORING_OP_URING_CMD). Every device accepts these as the sqe cmd_op,
+//with a struct dm510_uring_cmd in the sqe cmd area. A read or write that can be done at once
+//completes at once, like a non-blocking read() or write(). Otherwise it stays queued without
+//any thread blocking, and completes once the buffer has data or room, with the cqe res set as
+//read() or write() would return it. DM510_URING_CANCEL cancels (ECANCELED) all queued commands
+//of the file. Closing an fd of the file, which includes a process exiting with it open, only
+//cancels the commands that process submitted, so a forked child exiting leaves its parent's alone
+#define DM510_URING_READ 1  //Read into addr, like read()
+#define DM510_URING_WRITE 2  //Write from addr, like write()
+#define DM510_URING_CANCEL 3  //Cancel the queued commands of this file, res is how many
+
+struct dm510_uring_cmd {
+    unsigned long long addr;  //User buffer, cast from a pointer
+    unsigned int len;  //Size of addr in bytes
+    unsigned int flags;  //Must be 0
+};
+
+//Argument of GET_LATENCY_HISTOGRAM
+struct dm510_latency {
+    unsigned long long buckets[DM510_LATENCY_BUCKETS];  //Records read, by latency
+};
 
 #endif /* end of include guard: IOCTL_COMMANDS */